@@ -11,28 +11,27 @@
 /*
  * This is the default path where the driver will look for the
  * default tracefiles. You can override it at runtime with the -t flag.
+ * "make bench" generates the traces here (and at larger scales in
+ * bench/traces/medium and bench/traces/large).
  */
-#define TRACEDIR "/users/profs/info/francesco.zappa-nardelli/malloclab-traces/"
+#define TRACEDIR "bench/traces/small/"
 
 /*
  * This is the list of default tracefiles in TRACEDIR that the driver
- * will use for testing. Modify this if you want to add or delete
- * traces from the driver's test suite. For example, if you don't want
- * your students to implement realloc, you can delete the last two
- * traces.
+ * will use for testing: the benchmark suite of bench/suite, which
+ * tracegen generates. Add a trace to both to add it to the suite.
  */
 #define DEFAULT_TRACEFILES \
-  "amptjp-bal.rep",\
-  "cccp-bal.rep",\
-  "cp-decl-bal.rep",\
-  "expr-bal.rep",\
-  "coalescing-bal.rep",\
-  "random-bal.rep",\
-  "random2-bal.rep",\
-  "binary-bal.rep",\
-  "binary2-bal.rep",\
-  "realloc-bal.rep",\
-  "realloc2-bal.rep"
+  "binary.rep",\
+  "binary2.rep",\
+  "coalescing.rep",\
+  "random.rep",\
+  "random2.rep",\
+  "realloc.rep",\
+  "realloc2.rep",\
+  "growth.rep",\
+  "prodcons.rep",\
+  "fragment.rep"
 
 /*
  * This constant gives the estimated performance of the libc malloc
@@ -53,12 +52,15 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (either 4 or 8, 16 in libmm.so) 
  */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8  
+#endif
 
 /* 
- * Maximum heap size in bytes 
+ * Default maximum heap size in bytes. The MM_MAX_HEAP environment
+ * variable or the driver's -m flag override it at run time.
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
@@ -69,4 +71,10 @@
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
 #define USE_GETTOD 1   /* gettimeofday (any Unix box) */
 
+/* 
+ * Runs of each trace that the interval timers average over with the
+ * driver's -F flag, instead of 10
+ */
+#define FUSED_RUNS 3
+
 #endif /* __CONFIG_H */
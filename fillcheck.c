@@ -0,0 +1,195 @@
+/*
+ * fillcheck.c - scalar, SSE2 and AVX2 kernels for filling a payload with
+ *     a pattern and checking it. The vector kernels hold 2 (SSE2) or 4
+ *     (AVX2) consecutive words of the pattern in a register, store or
+ *     compare 16 or 32 bytes per instruction, and add 2 or 4 steps to
+ *     move on. A byte mask from the compare locates the first bad byte.
+ *
+ * The vector kernels are compiled with target attributes and picked at
+ * run time from CPUID, so the binary still runs on CPUs without them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "fillcheck.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define FILLCHECK_X86 1
+#include <immintrin.h>
+#else
+#define FILLCHECK_X86 0
+#endif
+
+fill_funct fill_block = NULL;
+check_funct check_block = NULL;
+char *fillcheck_name = NULL;
+
+/******************
+ * Scalar kernels
+ ******************/
+
+static void fill_scalar(char *p, size_t n, unsigned long long key,
+			unsigned long long step)
+{
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8, key += step)
+	memcpy(p + i, &key, 8);
+    if (i < n)
+	memcpy(p + i, &key, n - i);
+}
+
+static size_t check_scalar(const char *p, size_t n, unsigned long long key,
+			   unsigned long long step)
+{
+    size_t i, j;
+    unsigned long long word;
+
+    for (i = 0; i < n; i += 8, key += step) {
+	word = key;  /* so that a short last word compares equal past n */
+	memcpy(&word, p + i, n - i < 8 ? n - i : 8);
+	if (word != key)
+	    for (j = 0; j < 8; j++)
+		if (((char *)&word)[j] != ((char *)&key)[j])
+		    return i + j;
+    }
+    return n;
+}
+
+#if FILLCHECK_X86
+
+/****************
+ * SSE2 kernels
+ ****************/
+
+__attribute__((target("sse2")))
+static void fill_sse2(char *p, size_t n, unsigned long long key,
+		      unsigned long long step)
+{
+    size_t i;
+    __m128i v = _mm_set_epi64x(key + step, key);
+    __m128i inc = _mm_set1_epi64x(2 * step);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+	_mm_storeu_si128((__m128i *)(p + i), v);
+	v = _mm_add_epi64(v, inc);
+    }
+    fill_scalar(p + i, n - i, key + i / 8 * step, step);
+}
+
+__attribute__((target("sse2")))
+static size_t check_sse2(const char *p, size_t n, unsigned long long key,
+			 unsigned long long step)
+{
+    size_t i;
+    unsigned int mask;
+    __m128i v = _mm_set_epi64x(key + step, key);
+    __m128i inc = _mm_set1_epi64x(2 * step);
+
+    for (i = 0; i + 16 <= n; i += 16) {
+	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+	    _mm_loadu_si128((const __m128i *)(p + i)), v));
+	if (mask != 0xffff)
+	    return i + __builtin_ctz(~mask);
+	v = _mm_add_epi64(v, inc);
+    }
+    return i + check_scalar(p + i, n - i, key + i / 8 * step, step);
+}
+
+/****************
+ * AVX2 kernels
+ ****************/
+
+__attribute__((target("avx2")))
+static void fill_avx2(char *p, size_t n, unsigned long long key,
+		      unsigned long long step)
+{
+    size_t i;
+    __m256i v = _mm256_set_epi64x(key + 3 * step, key + 2 * step,
+				  key + step, key);
+    __m256i inc = _mm256_set1_epi64x(4 * step);
+
+    for (i = 0; i + 32 <= n; i += 32) {
+	_mm256_storeu_si256((__m256i *)(p + i), v);
+	v = _mm256_add_epi64(v, inc);
+    }
+    fill_scalar(p + i, n - i, key + i / 8 * step, step);
+}
+
+__attribute__((target("avx2")))
+static size_t check_avx2(const char *p, size_t n, unsigned long long key,
+			 unsigned long long step)
+{
+    size_t i;
+    unsigned int mask;
+    __m256i v = _mm256_set_epi64x(key + 3 * step, key + 2 * step,
+				  key + step, key);
+    __m256i inc = _mm256_set1_epi64x(4 * step);
+
+    for (i = 0; i + 32 <= n; i += 32) {
+	mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+	    _mm256_loadu_si256((const __m256i *)(p + i)), v));
+	if (mask != 0xffffffff)
+	    return i + __builtin_ctz(~mask);
+	v = _mm256_add_epi64(v, inc);
+    }
+    return i + check_scalar(p + i, n - i, key + i / 8 * step, step);
+}
+
+#endif /* FILLCHECK_X86 */
+
+static fillcheck_t impls[] = {
+    {"scalar", fill_scalar, check_scalar},
+#if FILLCHECK_X86
+    {"sse2", fill_sse2, check_sse2},
+    {"avx2", fill_avx2, check_avx2},
+#endif
+};
+
+/*
+ * fillcheck_impls - return the table of kernels built into the binary
+ */
+int fillcheck_impls(fillcheck_t **table)
+{
+    *table = impls;
+    return sizeof(impls) / sizeof(fillcheck_t);
+}
+
+/*
+ * fillcheck_supported - does the CPU running us support this kernel?
+ */
+int fillcheck_supported(fillcheck_t *impl)
+{
+#if FILLCHECK_X86
+    __builtin_cpu_init();
+    if (!strcmp(impl->name, "sse2"))
+	return __builtin_cpu_supports("sse2");
+    if (!strcmp(impl->name, "avx2"))
+	return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/*
+ * fillcheck_init - select the last (widest) kernel the CPU supports.
+ *     The FILLCHECK environment variable names a kernel to use instead.
+ */
+void fillcheck_init(void)
+{
+    int i, n = sizeof(impls) / sizeof(fillcheck_t);
+    char *name = getenv("FILLCHECK");
+    fillcheck_t *pick = &impls[0];
+
+    if (fill_block != NULL)
+	return;
+    for (i = 0; i < n; i++) {
+	if (!fillcheck_supported(&impls[i]))
+	    continue;
+	if (name == NULL || !strcmp(name, impls[i].name))
+	    pick = &impls[i];
+    }
+    fill_block = pick->fill;
+    check_block = pick->check;
+    fillcheck_name = pick->name;
+}
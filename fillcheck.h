@@ -0,0 +1,44 @@
+/*
+ * fillcheck.h - kernels that fill a payload with a pattern, and check
+ *     that a payload still holds one, for the correctness pass of
+ *     mdriver. Word k (8 bytes, host byte order) of a payload filled
+ *     with pattern (key, step) is key + k * step, so a step of 0
+ *     repeats the key and any other step also tells the words apart.
+ */
+#ifndef __FILLCHECK_H_
+#define __FILLCHECK_H_
+
+#include <stddef.h>
+
+/* Fill n bytes at p with the pattern */
+typedef void (*fill_funct)(char *p, size_t n, unsigned long long key,
+			   unsigned long long step);
+
+/* Return the offset of the first of n bytes at p off the pattern, or n */
+typedef size_t (*check_funct)(const char *p, size_t n, unsigned long long key,
+			      unsigned long long step);
+
+typedef struct {
+    char *name;           /* "scalar", "sse2" or "avx2" */
+    fill_funct fill;
+    check_funct check;
+} fillcheck_t;
+
+/* Pick the fastest kernels this CPU supports (CPUID), once */
+void fillcheck_init(void);
+
+/* Kernels picked by fillcheck_init */
+extern fill_funct fill_block;
+extern check_funct check_block;
+extern char *fillcheck_name;
+
+/*
+ * Every kernel built into this binary, scalar first. Returns the
+ * number of entries, some of which the CPU may not support.
+ */
+int fillcheck_impls(fillcheck_t **impls);
+
+/* Does the CPU support this kernel? */
+int fillcheck_supported(fillcheck_t *impl);
+
+#endif /* __FILLCHECK_H_ */
@@ -0,0 +1,90 @@
+/*
+ * fitbench.c - microbenchmark for the fit search kernels in fitscan.c.
+ *
+ * For a range of array lengths, fills an array with random block sizes
+ * and times many probes of each kernel the CPU supports with the cycle
+ * counter. A probe is one call that searches the whole array for a
+ * random request size. Reports cycles per probe and per size examined.
+ *
+ * usage: fitbench [-p <probes>] [-s <seed>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "fitscan.h"
+#include "clock.h"
+
+#define MAXLEN  16384  /* longest array of sizes */
+#define NPROBE  4096   /* distinct request sizes, reused round robin */
+
+static unsigned int sizes[MAXLEN];
+static unsigned int probes[NPROBE];
+static volatile int sink;  /* keeps the kernel calls alive */
+
+/*
+ * time_kernel - average cycles of one call of f over nprobes probes
+ */
+static double time_kernel(fitscan_funct f, int len, int nprobes)
+{
+    int i, r = 0;
+    double cycles;
+
+    for (i = 0; i < NPROBE; i++)  /* warm up the caches */
+	r += f(sizes, len, probes[i]);
+    start_counter();
+    for (i = 0; i < nprobes; i++)
+	r += f(sizes, len, probes[i % NPROBE]);
+    cycles = get_counter();
+    sink = r;
+    return cycles / nprobes;
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, k, n, len;
+    int nprobes = 100000;
+    unsigned int seed = 1;
+    double first, best;
+    fitscan_t *impls;
+
+    while ((c = getopt(argc, argv, "p:s:h")) != EOF) {
+	switch (c) {
+	case 'p':
+	    nprobes = atoi(optarg);
+	    break;
+	case 's':
+	    seed = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: fitbench [-p <probes>] [-s <seed>]\n");
+	    exit(c != 'h');
+	}
+    }
+
+    /* 
+     * Sizes of one size class: up to 25% apart, like a class of the 
+     * default table. Most requests fit only late in the array or not
+     * at all, which is the case the search has to be fast for.
+     */
+    srand(seed);
+    for (i = 0; i < MAXLEN; i++)
+	sizes[i] = 4096 + 8 * (rand() % 128);
+    for (i = 0; i < NPROBE; i++)
+	probes[i] = 4096 + 8 * (rand() % 132);
+
+    n = fitscan_impls(&impls);
+    printf("%7s %8s %12s %12s %10s\n", 
+	   "sizes", "kernel", "first cyc", "best cyc", "cyc/size");
+    for (len = 16; len <= MAXLEN; len *= 4) {
+	for (k = 0; k < n; k++) {
+	    if (!fitscan_supported(&impls[k]))
+		continue;
+	    first = time_kernel(impls[k].first, len, nprobes);
+	    best = time_kernel(impls[k].best, len, nprobes);
+	    printf("%7d %8s %12.1f %12.1f %10.3f\n", 
+		   len, impls[k].name, first, best, best / len);
+	}
+    }
+    return 0;
+}
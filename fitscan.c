@@ -0,0 +1,272 @@
+/*
+ * fitscan.c - scalar, SSE2 and AVX2 kernels for searching an array of 
+ *     block sizes. The vector kernels compare 4 (SSE2) or 8 (AVX2) sizes
+ *     per instruction against the request. Neither instruction set has
+ *     an unsigned 32-bit compare, so sizes are biased by 2^31 and 
+ *     compared as signed integers.
+ *
+ * The vector kernels are compiled with target attributes and picked at
+ * run time from CPUID, so the binary still runs on CPUs without them.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "fitscan.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define FITSCAN_X86 1
+#include <immintrin.h>
+#else
+#define FITSCAN_X86 0
+#endif
+
+#define BIAS 0x80000000u
+
+fitscan_funct fit_first = NULL;
+fitscan_funct fit_best = NULL;
+
+/******************
+ * Scalar kernels
+ ******************/
+
+static int first_scalar(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i;
+
+    if (asize == 0)
+	asize = 1;
+
+    for (i = 0; i < n; i++)
+	if (sizes[i] >= asize)
+	    return i;
+    return -1;
+}
+
+static int best_scalar(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i, best = -1;
+    unsigned int best_size = 0xffffffff;
+
+    if (asize == 0)
+	asize = 1;
+    for (i = 0; i < n; i++) {
+	if (sizes[i] >= asize && sizes[i] < best_size) {
+	    best = i;
+	    best_size = sizes[i];
+	    if (best_size == asize)
+		break;
+	}
+    }
+    return best;
+}
+
+#if FITSCAN_X86
+
+/****************
+ * SSE2 kernels
+ ****************/
+
+__attribute__((target("sse2")))
+static int first_sse2(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i, mask;
+    __m128i bias = _mm_set1_epi32(BIAS);
+    __m128i key, v;
+
+    if (asize == 0)
+	asize = 1;
+    key = _mm_set1_epi32((asize - 1) ^ BIAS);  /* v >= a iff v > a-1 */
+    for (i = 0; i + 4 <= n; i += 4) {
+	v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(sizes + i)), bias);
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, key)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++)
+	if (sizes[i] >= asize)
+	    return i;
+    return -1;
+}
+
+__attribute__((target("sse2")))
+static int best_sse2(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i, j, mask;
+    unsigned int lanes[4];
+    unsigned int best_size = 0xffffffff;
+    __m128i bias = _mm_set1_epi32(BIAS);
+    __m128i none = _mm_set1_epi32(0x7fffffff);  /* biased 0xffffffff */
+    __m128i min = none;
+    __m128i key, exact, v, fits, lt;
+
+    if (asize == 0)
+	asize = 1;
+    key = _mm_set1_epi32((asize - 1) ^ BIAS);
+    exact = _mm_set1_epi32(asize);
+    for (i = 0; i + 4 <= n; i += 4) {
+	v = _mm_loadu_si128((const __m128i *)(sizes + i));
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, exact)));
+	if (mask)  /* an exact fit is the best one */
+	    return i + __builtin_ctz(mask);
+	v = _mm_xor_si128(v, bias);
+	fits = _mm_cmpgt_epi32(v, key);
+	v = _mm_or_si128(_mm_and_si128(fits, v), _mm_andnot_si128(fits, none));
+	lt = _mm_cmplt_epi32(v, min);
+	min = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, min));
+    }
+    _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(min, bias));
+    for (j = 0; j < 4; j++)
+	if (lanes[j] < best_size)
+	    best_size = lanes[j];
+    for (; i < n; i++)
+	if (sizes[i] >= asize && sizes[i] < best_size)
+	    best_size = sizes[i];
+    if (best_size == 0xffffffff)
+	return -1;
+
+    /* Second pass: position of the first occurrence of the minimum */
+    key = _mm_set1_epi32(best_size);
+    for (i = 0; i + 4 <= n; i += 4) {
+	v = _mm_loadu_si128((const __m128i *)(sizes + i));
+	mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, key)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++)
+	if (sizes[i] == best_size)
+	    return i;
+    return -1;
+}
+
+/****************
+ * AVX2 kernels
+ ****************/
+
+__attribute__((target("avx2")))
+static int first_avx2(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i, mask;
+    __m256i bias = _mm256_set1_epi32(BIAS);
+    __m256i key, v;
+
+    if (asize == 0)
+	asize = 1;
+    key = _mm256_set1_epi32((asize - 1) ^ BIAS);
+    for (i = 0; i + 8 <= n; i += 8) {
+	v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(sizes + i)),
+			     bias);
+	mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+				      _mm256_cmpgt_epi32(v, key)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++)
+	if (sizes[i] >= asize)
+	    return i;
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static int best_avx2(const unsigned int *sizes, int n, unsigned int asize)
+{
+    int i, j, mask;
+    unsigned int lanes[8];
+    unsigned int best_size = 0xffffffff;
+    __m256i none = _mm256_set1_epi32(0xffffffff);
+    __m256i min = none;
+    __m256i key, v, fits;
+
+    if (asize == 0)
+	asize = 1;
+    key = _mm256_set1_epi32(asize);
+    for (i = 0; i + 8 <= n; i += 8) {
+	/* AVX2 has unsigned min, and v >= a iff max(v, a) == v */
+	v = _mm256_loadu_si256((const __m256i *)(sizes + i));
+	mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+				      _mm256_cmpeq_epi32(v, key)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+	fits = _mm256_cmpeq_epi32(_mm256_max_epu32(v, key), v);
+	v = _mm256_blendv_epi8(none, v, fits);
+	min = _mm256_min_epu32(min, v);
+    }
+    _mm256_storeu_si256((__m256i *)lanes, min);
+    for (j = 0; j < 8; j++)
+	if (lanes[j] < best_size)
+	    best_size = lanes[j];
+    for (; i < n; i++)
+	if (sizes[i] >= asize && sizes[i] < best_size)
+	    best_size = sizes[i];
+    if (best_size == 0xffffffff)
+	return -1;
+
+    key = _mm256_set1_epi32(best_size);
+    for (i = 0; i + 8 <= n; i += 8) {
+	v = _mm256_loadu_si256((const __m256i *)(sizes + i));
+	mask = _mm256_movemask_ps(_mm256_castsi256_ps(
+				      _mm256_cmpeq_epi32(v, key)));
+	if (mask)
+	    return i + __builtin_ctz(mask);
+    }
+    for (; i < n; i++)
+	if (sizes[i] == best_size)
+	    return i;
+    return -1;
+}
+
+#endif /* FITSCAN_X86 */
+
+static fitscan_t impls[] = {
+    {"scalar", first_scalar, best_scalar},
+#if FITSCAN_X86
+    {"sse2", first_sse2, best_sse2},
+    {"avx2", first_avx2, best_avx2},
+#endif
+};
+
+/*
+ * fitscan_impls - return the table of kernels built into the binary
+ */
+int fitscan_impls(fitscan_t **table)
+{
+    *table = impls;
+    return sizeof(impls) / sizeof(fitscan_t);
+}
+
+/*
+ * fitscan_supported - does the CPU running us support this kernel?
+ */
+int fitscan_supported(fitscan_t *impl)
+{
+#if FITSCAN_X86
+    __builtin_cpu_init();
+    if (!strcmp(impl->name, "sse2"))
+	return __builtin_cpu_supports("sse2");
+    if (!strcmp(impl->name, "avx2"))
+	return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/*
+ * fitscan_init - select the last (widest) kernel the CPU supports.
+ *     The FITSCAN environment variable names a kernel to use instead.
+ */
+void fitscan_init(void)
+{
+    int i, n = sizeof(impls) / sizeof(fitscan_t);
+    char *name = getenv("FITSCAN");
+    fitscan_t *pick = &impls[0];
+
+    if (fit_first != NULL)
+	return;
+    for (i = 0; i < n; i++) {
+	if (!fitscan_supported(&impls[i]))
+	    continue;
+	if (name == NULL || !strcmp(name, impls[i].name))
+	    pick = &impls[i];
+    }
+    fit_first = pick->first;
+    fit_best = pick->best;
+}
@@ -0,0 +1,40 @@
+/*
+ * fitscan.h - vector kernels that search a dense array of block sizes
+ *     for a free block that fits a request. Used by the out-of-band
+ *     index in mm.c (INDEX=1) and by the fitbench microbenchmark.
+ */
+#ifndef __FITSCAN_H_
+#define __FITSCAN_H_
+
+/* 
+ * A kernel returns the position of the first size >= asize, or of the
+ * smallest such size (the first one if there are ties), and -1 if no 
+ * size in sizes[0..n-1] fits. Block sizes are never 0, so an asize 
+ * of 0 is treated as 1.
+ */
+typedef int (*fitscan_funct)(const unsigned int *sizes, int n, 
+			     unsigned int asize);
+
+typedef struct {
+    char *name;           /* "scalar", "sse2" or "avx2" */
+    fitscan_funct first;  /* first fitting size */
+    fitscan_funct best;   /* smallest fitting size */
+} fitscan_t;
+
+/* Pick the fastest kernels this CPU supports (CPUID), once */
+void fitscan_init(void);
+
+/* Kernels picked by fitscan_init */
+extern fitscan_funct fit_first;
+extern fitscan_funct fit_best;
+
+/* 
+ * Every kernel built into this binary, scalar first. Returns the
+ * number of entries, some of which the CPU may not support.
+ */
+int fitscan_impls(fitscan_t **impls);
+
+/* Does the CPU support this kernel? */
+int fitscan_supported(fitscan_t *impl);
+
+#endif /* __FITSCAN_H_ */
@@ -9,6 +9,7 @@
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static int runs = 10; /* runs the interval timers average over */
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -48,10 +49,17 @@ double fsecs(fsecs_test_funct f, void *argp)
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
 #elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
+    return ftimer_itimer(f, argp, runs);
 #elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+    return ftimer_gettod(f, argp, runs);
 #endif 
 }
 
-
+/*
+ * set_fsecs_runs - Average the interval timers over n runs of f
+ *     (the K-best scheme of fcyc decides for itself)
+ */
+void set_fsecs_runs(int n)
+{
+    runs = n;
+}
@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE  /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -15,11 +16,18 @@
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "perfctr.h"
 #include "config.h"
+#include "trace.h"
+#include "fillcheck.h"
 
 /**********************
  * Constants and macros
@@ -29,6 +37,8 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXSWEEP      16 /* max number of values of a -k or -d sweep */
+#define RSS_SAMPLES   64 /* resident size samples per trace in eval_mm_util */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,30 +47,24 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload, as a shadow bitmap of the
+ * heap with one bit per ALIGNMENT bytes, set if a payload covers them.
+ * Payloads start ALIGNMENT-aligned, so two of them overlap exactly when
+ * their runs of bits do.
+ */
 typedef struct range_t {
-    char *lo;              /* low payload address */
-    char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned long *bits;   /* the bitmap */
+    size_t nbits;          /* bits in it, enough for the largest heap */
+    size_t hwm;            /* no bit from here on is set */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+#define WORD_BITS (8 * sizeof(unsigned long))
+#define NO_BIT    ((size_t)-1)
 
-/* Holds the information for one trace file*/
-typedef struct {
-    int sugg_heapsize;   /* suggested heap size (unused) */
-    int num_ids;         /* number of alloc/realloc ids */
-    int num_ops;         /* number of distinct requests */
-    int weight;          /* weight for this trace (unused) */
-    traceop_t *ops;      /* array of requests */
-    char **blocks;       /* array of ptrs returned by malloc/realloc... */
-    size_t *block_sizes; /* ... and a corresponding array of payload sizes */
-} trace_t;
+/* The bit for address p, counted from the aligned base of the heap */
+#define HEAP_BASE  ((char *)((size_t)mem_heap_lo() & ~(size_t)(ALIGNMENT-1)))
+#define GRANULE(p) ((size_t)((char *)(p) - HEAP_BASE) / ALIGNMENT)
 
 /* 
  * Holds the params to the xxx_speed functions, which are timed by fcyc. 
@@ -81,10 +85,24 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double resident; /* heap bytes backed by pages at the end of the trace */
+    double peak_resident; /* most heap bytes backed by pages at a sample */
+    double heap;     /* heap size (brk extent) at the end of the trace */
+    double rss_util; /* peak payload over peak resident bytes */
+    double avg_util; /* payload over heap size, averaged over the requests */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* The running totals of one utilization measurement of a trace */
+typedef struct {
+    int total_size;       /* payload bytes allocated now */
+    int max_total_size;   /* ... and the most there were */
+    int sample_every;     /* requests between samples of the resident size */
+    double peak_resident; /* most heap bytes resident at a sample */
+    double sum_util;      /* payload over heap size, summed over requests */
+} util_t;
+
 /********************
  * Global variables
  *******************/
@@ -100,20 +118,42 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* Fit search cutoffs given with -k; more than one asks for a sweep */
+static int fitlimits[MAXSWEEP];
+static int num_fitlimits = 0;
+
+/* Prefetch distances given with -d; more than one asks for a sweep */
+static int prefetches[MAXSWEEP];
+static int num_prefetches = 0;
+
+static int hwcounters = 0; /* If set, report hardware counters (-c) */
+static int expand = 1;     /* Run this many interleaved copies of each trace (-x) */
+static int hugepages = -1; /* Page backing of the heap (-H), -1 for memlib's default */
+static int window_start = 0; /* Time only ops [window_start, window_end) (-w) */
+static int window_end = -1;  /* ... or the whole trace if negative */
+static int window_first, window_last; /* the window, cut to the current trace */
+static int streaming = 0;    /* Stream the traces instead of reading them in (-s) */
+static int randfill = 0;     /* Fill each block with a pattern of its own (-R) */
+static int fuse_sample = 0;  /* Check validity and util in one pass, all of the 
+				payload of one id in this many (-F), or 0 */
+static int jobs = 1;         /* Traces checked at once, each in a process (-j) */
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate the range map */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
-static void remove_range(range_t **ranges, char *lo);
+static void remove_range(range_t **ranges, char *lo, int size);
 static void clear_ranges(range_t **ranges);
+static void free_ranges(range_t **ranges);
+static size_t find_bit(unsigned long *bits, size_t a, size_t b);
+static void fill_bits(unsigned long *bits, size_t a, size_t b, int set);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
-static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
@@ -121,12 +161,38 @@ static void eval_libc_speed(void *ptr);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static void block_pattern(int index, char *p, unsigned long long *key,
+			  unsigned long long *step);
+static void fill_ends(char *p, int size, unsigned long long key,
+		      unsigned long long step);
+static int check_ends(char *p, int size, int oldsize, unsigned long long key,
+		      unsigned long long step);
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 stats_t *stats);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats);
+static int check_trace(trace_t *trace, int tracenum, range_t **ranges,
+		       stats_t *stats);
+static void check_parallel(char **tracefiles, int n, stats_t *stats);
+static void util_start(util_t *u, trace_t *trace);
+static void util_request(util_t *u, int i, stats_t *stats);
+static void util_add(util_t *u, int delta);
+static double util_end(util_t *u, trace_t *trace, stats_t *stats);
 static void eval_mm_speed(void *ptr);
+static int start_window(trace_t *trace);
+static double time_mm_speed(speed_t *params);
+static void eval_mm_restore(void *ptr);
+static void replay(trace_t *trace, int first, int last);
+static void sweep(char *title, char *label, int *values, int num_values,
+		  void (*set)(int), char **tracefiles, int num_tracefiles);
+static void set_hugepages(int huge);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printmemory(int n, stats_t *stats);
+static void writeresults(char *outfile, char **tracefiles, int n, 
+			 stats_t *stats, double perfindex);
+static void touch_pages(char *p, int size);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -139,6 +205,7 @@ int main(int argc, char **argv)
 {
     int i;
     char c;
+    size_t len;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
@@ -147,6 +214,7 @@ int main(int argc, char **argv)
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
+    char *outfile = NULL;/* If set, write the results here as CSV (-o) */
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
@@ -158,7 +226,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:k:d:x:m:H:p:w:o:F:j:chvVgalnsR")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -178,12 +246,71 @@ int main(int argc, char **argv)
 	    if (tracedir[strlen(tracedir)-1] != '/') 
 		strcat(tracedir, "/"); /* path always ends with "/" */
 	    break;
+	case 'k': /* Fit search cutoff for mm_malloc (repeat for a sweep) */
+	    if (num_fitlimits == MAXSWEEP)
+		app_error("ERROR: too many -k values");
+	    fitlimits[num_fitlimits++] = atoi(optarg);
+	    break;
+	case 'd': /* Prefetch distance for mm.c (repeat for a sweep) */
+	    if (num_prefetches == MAXSWEEP)
+		app_error("ERROR: too many -d values");
+	    prefetches[num_prefetches++] = atoi(optarg);
+	    break;
+	case 'c': /* Report hardware counters for the mm speed runs */
+	    hwcounters = 1;
+	    break;
+	case 'm': /* Maximum heap size, e.g. 512M or 4G */
+	    if (mem_parse_size(optarg) == 0)
+		app_error("ERROR: -m needs a size such as 64M or 2G");
+	    mem_set_maxheap(mem_parse_size(optarg));
+	    break;
+	case 'H': /* Back the heap with huge pages: 1 for THP, 2 for hugetlb */
+	    hugepages = atoi(optarg);
+	    if (hugepages < MEM_HUGE_OFF || hugepages > MEM_HUGE_TLB)
+		app_error("ERROR: -H needs 0 (off), 1 (THP) or 2 (hugetlb)");
+	    mem_set_hugepages(hugepages);
+	    break;
+	case 'p': /* Keep the heap in a file */
+	    mem_set_file(optarg);
+	    break;
+	case 'w': /* Time only the ops from start up to end */
+	    if (sscanf(optarg, "%d:%d", &window_start, &window_end) != 2 ||
+		window_start < 0 || window_end <= window_start)
+		app_error("ERROR: -w needs start:end with 0 <= start < end");
+	    break;
+	case 'o': /* Write the results to a file, one line per trace */
+	    outfile = optarg;
+	    break;
+	case 's': /* Stream the traces from disk a chunk at a time */
+	    streaming = 1;
+	    break;
+	case 'R': /* Fill each block with a random pattern of its own */
+	    randfill = 1;
+	    break;
+	case 'F': /* Check validity and util in one pass, sampling payloads */
+	    fuse_sample = atoi(optarg);
+	    if (fuse_sample < 1)
+		app_error("ERROR: -F needs a positive count");
+	    break;
+	case 'j': /* Check n traces at once */
+	    jobs = atoi(optarg);
+	    if (jobs < 1)
+		app_error("ERROR: -j needs a positive count");
+	    break;
+	case 'x': /* Expand each trace into n interleaved copies */
+	    expand = atoi(optarg);
+	    if (expand < 1)
+		app_error("ERROR: -x needs a positive count");
+	    break;
         case 'a': /* Don't check team structure */
             team_check = 0;
             break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+	case 'n': /* Search the free lists of mm.c, not its index */
+	    mm_set_index(0);
+	    break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -198,6 +325,8 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    if (streaming && expand > 1)
+	app_error("ERROR: -x needs the traces in memory, so not with -s");
 	
     /* 
      * Check and print team info 
@@ -237,6 +366,14 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (fuse_sample)
+	set_fsecs_runs(FUSED_RUNS);
+
+    /* Pick the payload fill and check kernels */
+    fillcheck_init();
+    if (verbose > 1)
+	printf("Filling and checking payloads with the %s kernels\n", 
+	       fillcheck_name);
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -263,7 +400,7 @@ int main(int argc, char **argv)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
 	    }
-	    free_trace(trace);
+	    trace_free(trace);
 	}
 
 	/* Display the libc results in a compact table */
@@ -286,34 +423,91 @@ int main(int argc, char **argv)
     
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
+    if (jobs > 1 && mem_shared_area(&len) != NULL)
+	app_error("ERROR: -j needs a private heap, so not with -p or MM_HEAP_FILE");
+
+    /* The first -k and -d values, if any, are the ones used for the score */
+    if (num_fitlimits > 0)
+	mm_set_fitlimit(fitlimits[0]);
+    if (num_prefetches > 0)
+	mm_set_prefetch(prefetches[0]);
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
+    /* 
+     * Evaluate student's mm malloc package using the K-best scheme. With
+     * -j, check all the traces first, several at once, and then time 
+     * the valid ones one at a time.
+     */
+    if (jobs > 1)
+	check_parallel(tracefiles, num_tracefiles, mm_stats);
     for (i=0; i < num_tracefiles; i++) {
+	if (jobs > 1 && !mm_stats[i].valid)
+	    continue;
 	trace = read_trace(tracedir, tracefiles[i]);
 	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
+	if (jobs == 1)
+	    mm_stats[i].valid = check_trace(trace, i, &ranges, &mm_stats[i]);
 	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
 	    speed_params.trace = trace;
 	    speed_params.ranges = ranges;
-	    if (verbose > 1)
+	    if (verbose > 1 && jobs > 1)
+		printf("Checking mm_malloc for performance on trace %d.\n", i);
+	    else if (verbose > 1)
 		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    if (window_end >= 0)
+		mm_stats[i].ops = start_window(trace);
+	    mm_stats[i].secs = time_mm_speed(&speed_params);
+	    mem_snapshot_free();
 	}
-	free_trace(trace);
+	trace_free(trace);
     }
+    free_ranges(&ranges);
 
     /* Display the mm results in a compact table */
     if (verbose) {
 	printf("\nResults for mm malloc:\n");
 	printresults(num_tracefiles, mm_stats);
+	printf("\nMemory use of mm malloc:\n");
+	printmemory(num_tracefiles, mm_stats);
 	printf("\n");
     }
 
+    /* Report how utilization and throughput vary with the cutoff */
+    if (num_fitlimits > 1) {
+	sweep("Fit search cutoff sweep", "K", fitlimits, num_fitlimits, 
+	      mm_set_fitlimit, tracefiles, num_tracefiles);
+	mm_set_fitlimit(fitlimits[0]);
+    }
+
+    /* 
+     * Report how prefetching changes speed and stalls. With -c alone,
+     * compare no prefetching against a few distances.
+     */
+    if (hwcounters && num_prefetches < 2) {
+	if (num_prefetches == 0) {
+	    prefetches[num_prefetches++] = 1;
+	    prefetches[num_prefetches++] = 2;
+	    prefetches[num_prefetches++] = 4;
+	}
+	for (i = num_prefetches; i > 0; i--)
+	    prefetches[i] = prefetches[i-1];
+	prefetches[0] = 0;
+	num_prefetches++;
+    }
+    if (num_prefetches > 1) {
+	sweep("Prefetch distance sweep", "D", prefetches, num_prefetches, 
+	      mm_set_prefetch, tracefiles, num_tracefiles);
+    }
+
+    /* Report the throughput with base pages against huge pages */
+    if (hugepages > MEM_HUGE_OFF) {
+	int backings[2];
+
+	backings[0] = MEM_HUGE_OFF;
+	backings[1] = mem_hugepages();
+	sweep("Huge page comparison (0 off, 1 THP, 2 hugetlb)", "H", 
+	      backings, 2, set_hugepages, tracefiles, num_tracefiles);
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -357,6 +551,9 @@ int main(int argc, char **argv)
 	printf("Terminated with %d errors\n", errors);
     }
 
+    if (outfile != NULL)
+	writeresults(outfile, tracefiles, num_tracefiles, mm_stats, perfindex);
+
     if (autograder) {
 	printf("correct:%d\n", numcorrect);
 	printf("perfidx:%.0f\n", perfindex);
@@ -367,22 +564,24 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range map, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range map to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we mark its extent in the range map.
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    char *heap_lo = (char *)mem_heap_lo();
+    range_t *r = *ranges;
+    size_t a, b, bit;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -396,8 +595,8 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    if ((lo < heap_lo) || (lo > (char *)mem_heap_hi()) || 
+	(hi < heap_lo) || (hi > (char *)mem_heap_hi())) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -405,62 +604,104 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    a = GRANULE(lo);
+    b = GRANULE(hi);
+    assert(b < r->nbits);
+    if ((bit = find_bit(r->bits, a, b)) != NO_BIT) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload at %p\n",
+		lo, hi, HEAP_BASE + bit * ALIGNMENT);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
-    /* 
-     * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
-     */
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-	unix_error("malloc error in add_range");
-    p->next = *ranges;
-    p->lo = lo;
-    p->hi = hi;
-    *ranges = p;
+    /* Everything looks OK, so remember the extent of this block */
+    fill_bits(r->bits, a, b, 1);
+    if (b >= r->hwm)
+	r->hwm = b + 1;
     return 1;
 }
 
 /* 
- * remove_range - Free the range record of block whose payload starts at lo 
+ * remove_range - Clear the extent of the block of size bytes whose
+ *     payload starts at lo 
  */
-static void remove_range(range_t **ranges, char *lo)
+static void remove_range(range_t **ranges, char *lo, int size)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
+    if (lo == NULL || size <= 0)
+	return;
+    fill_bits((*ranges)->bits, GRANULE(lo), GRANULE(lo + size - 1), 0);
+}
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+/*
+ * clear_ranges - forget the extents of all the blocks of a trace,
+ *     making the range map on first use
+ */
+static void clear_ranges(range_t **ranges)
+{
+    range_t *r = *ranges;
+
+    if (r == NULL) {
+	if ((r = (range_t *)calloc(1, sizeof(range_t))) == NULL)
+	    unix_error("calloc error in clear_ranges");
+	r->nbits = mem_maxheap() / ALIGNMENT + 2;
+	if ((r->bits = (unsigned long *)calloc((r->nbits + WORD_BITS - 1) / 
+					       WORD_BITS, sizeof(long))) == NULL)
+	    unix_error("calloc error in clear_ranges");
+	*ranges = r;
     }
+    memset(r->bits, 0, (r->hwm + WORD_BITS - 1) / WORD_BITS * sizeof(long));
+    r->hwm = 0;
 }
 
 /*
- * clear_ranges - free all of the range records for a trace 
+ * free_ranges - free the range map
  */
-static void clear_ranges(range_t **ranges)
+static void free_ranges(range_t **ranges)
+{
+    if (*ranges != NULL) {
+	free((*ranges)->bits);
+	free(*ranges);
+	*ranges = NULL;
+    }
+}
+
+/*
+ * find_bit - return the first set bit from bit a to bit b, or NO_BIT
+ */
+static size_t find_bit(unsigned long *bits, size_t a, size_t b)
 {
-    range_t *p;
-    range_t *pnext;
+    size_t w = a / WORD_BITS, last = b / WORD_BITS;
+    unsigned long word = bits[w] & (~0UL << (a % WORD_BITS));
+
+    while (1) {
+	if (w == last)
+	    word &= ~0UL >> (WORD_BITS - 1 - b % WORD_BITS);
+	if (word != 0)
+	    return w * WORD_BITS + __builtin_ctzl(word);
+	if (w == last)
+	    return NO_BIT;
+	word = bits[++w];
+    }
+}
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+/*
+ * fill_bits - set, or clear, the bits from bit a to bit b
+ */
+static void fill_bits(unsigned long *bits, size_t a, size_t b, int set)
+{
+    size_t w = a / WORD_BITS, last = b / WORD_BITS;
+    unsigned long mask = ~0UL << (a % WORD_BITS);
+
+    for (; ; w++, mask = ~0UL) {
+	if (w == last)
+	    mask &= ~0UL >> (WORD_BITS - 1 - b % WORD_BITS);
+	if (set)
+	    bits[w] |= mask;
+	else
+	    bits[w] &= ~mask;
+	if (w == last)
+	    break;
     }
-    *ranges = NULL;
 }
 
 
@@ -469,122 +710,123 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file, text or binary, and store it in memory,
+ *     or with -s open it to be streamed
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
+    trace_t *trace;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
 
-    /* Allocate the trace record */
-    if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
-	unix_error("malloc 1 failed in read_trance");
-	
-    /* Read the trace file header */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
-	unix_error(msg);
-    }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
-
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
-    
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
-	op_index++;
-	
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
+    if (streaming)
+	return trace_open(path);
+    trace = trace_read(path);
+
+    if (expand > 1)
+	trace_expand(trace, expand);
     return trace;
 }
 
+/**********************************************************************
+ * The following functions evaluate the correctness, space utilization,
+ * and throughput of the libc and mm malloc packages.
+ **********************************************************************/
+
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * block_pattern - the pattern that eval_mm_valid fills the block of id
+ *     index at p with: the low byte of the id in every byte or, with -R,
+ *     words drawn from the id and the address that differ from each
+ *     other, so that a copy from the wrong block or to the wrong offset
+ *     shows up too
  */
-void free_trace(trace_t *trace)
+static void block_pattern(int index, char *p, unsigned long long *key,
+			  unsigned long long *step)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
-    free(trace->block_sizes);
-    free(trace);              /* and the trace record itself... */
+    unsigned long long z;
+
+    if (!randfill) {
+	*key = 0x0101010101010101ULL * (index & 0xFF);
+	*step = 0;
+	return;
+    }
+
+    /* splitmix64 of the id and address */
+    z = ((unsigned long long)index << 32) ^ (unsigned long long)(size_t)p;
+    z += 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    *key = z;
+    *step = (z * 0x9e3779b97f4a7c15ULL) | 1;
 }
 
-/**********************************************************************
- * The following functions evaluate the correctness, space utilization,
- * and throughput of the libc and mm malloc packages.
- **********************************************************************/
+/*
+ * fill_ends - fill only the first and the last word of a block with
+ *     its pattern
+ */
+static void fill_ends(char *p, int size, unsigned long long key,
+		      unsigned long long step)
+{
+    int last = (size - 1) / 8 * 8;
+
+    fill_block(p, size < 8 ? size : 8, key, step);
+    if (last > 0)
+	fill_block(p + last, size - last, key + last / 8 * step, step);
+}
+
+/*
+ * check_ends - check the first size bytes of a block that fill_ends
+ *     filled when it held oldsize bytes. Returns the offset of the first
+ *     bad byte, or size.
+ */
+static int check_ends(char *p, int size, int oldsize, unsigned long long key,
+		      unsigned long long step)
+{
+    int last = (oldsize - 1) / 8 * 8;
+    int n = size < 8 ? size : 8;
+    int bad;
+
+    if ((bad = check_block(p, n, key, step)) < n)
+	return bad;
+    if (last > 0 && last < size && 
+	(bad = check_block(p + last, size - last, key + last / 8 * step, 
+			   step)) < size - last)
+	return last + bad;
+    return size;
+}
 
 /*
- * eval_mm_valid - Check the mm malloc package for correctness
+ * eval_mm_valid - Check the mm malloc package for correctness.
+ *     If stats is not NULL (-F), also measure the utilization, as
+ *     eval_mm_util does, in the same pass. Every block is still checked
+ *     for alignment and overlap then, but only the blocks of one id in 
+ *     fuse_sample have all of their payload filled and checked, and the
+ *     rest only the first and last word.
  */
-static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges) 
+static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges,
+			 stats_t *stats) 
 {
-    int i, j;
+    int i, end = 0;
     int index;
     int size;
-    int oldsize;
+    int oldsize, kept;
+    int full = 1;
+    size_t bad, start;
+    unsigned long long key, step, newkey, newstep;
     char *newp;
     char *oldp;
     char *p;
+    util_t util;
+    const traceop_t *op = NULL;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and clear the range map */
+    if (stats != NULL)
+	mem_reset_pages();
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -593,13 +835,22 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	malloc_error(tracenum, 0, "mm_init failed.");
 	return 0;
     }
+    if (stats != NULL)
+	util_start(&util, trace);
 
     /* Interpret each operation in the trace in order */
-    for (i = 0;  i < trace->num_ops;  i++) {
-	index = trace->ops[i].index;
-	size = trace->ops[i].size;
+    for (i = 0;  i < trace->num_ops;  i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+	index = op->index;
+	size = op->size;
+	TRACE_NEED(trace, index);
+	if (stats != NULL) {
+	    util_request(&util, i, stats);
+	    full = (index % fuse_sample == 0);
+	}
 
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
 
@@ -611,66 +862,94 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range map if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+	    if (stats != NULL) {
+		touch_pages(p, size);
+		util_add(&util, size);
+	    }
 	    
 	    /* ADDED: cgw
-	     * fill range with low byte of index.  This will be used later
+	     * fill range with the pattern of the block, the low byte of
+	     * index unless -R.  This will be used later
 	     * if we realloc the block and wish to make sure that the old
 	     * data was copied to the new block
 	     */
-	    memset(p, index & 0xFF, size);
+	    block_pattern(index, p, &key, &step);
+	    if (full)
+		fill_block(p, size, key, step);
+	    else
+		fill_ends(p, size, key, step);
 
 	    /* Remember region */
-	    trace->blocks[index] = p;
-	    trace->block_sizes[index] = size;
+	    trace->blocks[index].p = p;
+	    trace->blocks[index].size = size;
 	    break;
 
         case REALLOC: /* mm_realloc */
 	    
 	    /* Call the student's realloc */
-	    oldp = trace->blocks[index];
+	    oldp = trace->blocks[index].p;
 	    if ((newp = mm_realloc(oldp, size)) == NULL) {
 		malloc_error(tracenum, i, "mm_realloc failed.");
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
-	    remove_range(ranges, oldp);
+	    /* Remove the old region from the range map */
+	    oldsize = trace->blocks[index].size;
+	    remove_range(ranges, oldp, oldsize);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range map */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
 	    /* ADDED: cgw
 	     * Make sure that the new block contains the data from the old 
-	     * block and then fill in the new block with the low order byte
-	     * of the new index
+	     * block and then fill in the new block with its pattern
 	     */
-	    oldsize = trace->block_sizes[index];
-	    if (size < oldsize) oldsize = size;
-	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
-		malloc_error(tracenum, i, "mm_realloc did not preserve the "
-			     "data from old block");
+	    kept = (size < oldsize) ? size : oldsize;
+	    block_pattern(index, oldp, &key, &step);
+	    bad = full ? check_block(newp, kept, key, step) : 
+		check_ends(newp, kept, oldsize, key, step);
+	    if (bad < kept) {
+		sprintf(msg, "mm_realloc did not preserve the data from old "
+			"block (byte %d of %d)", (int)bad, kept);
+		malloc_error(tracenum, i, msg);
 		return 0;
-	      }
 	    }
-	    memset(newp, index & 0xFF, size);
+	    if (stats != NULL) {
+		if (size > oldsize)
+		    touch_pages(newp + oldsize, size - oldsize);
+		util_add(&util, size - oldsize);
+	    }
+
+	    /* Only the bytes past the old data need filling if the 
+	       pattern has not changed */
+	    block_pattern(index, newp, &newkey, &newstep);
+	    if (full) {
+		start = 0;
+		if (newkey == key && newstep == step)
+		    start = kept & ~7;
+		fill_block(newp + start, size - start, 
+			   newkey + start / 8 * newstep, newstep);
+	    } else
+		fill_ends(newp, size, newkey, newstep);
 
 	    /* Remember region */
-	    trace->blocks[index] = newp;
-	    trace->block_sizes[index] = size;
+	    trace->blocks[index].p = newp;
+	    trace->blocks[index].size = size;
 	    break;
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
-	    p = trace->blocks[index];
-	    remove_range(ranges, p);
+	    /* Remove region from map and call student's free function */
+	    p = trace->blocks[index].p;
+	    remove_range(ranges, p, trace->blocks[index].size);
+	    if (stats != NULL)
+		util_add(&util, -(int)trace->blocks[index].size);
 	    mm_free(p);
 	    break;
 
@@ -680,6 +959,9 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
     }
 
+    if (stats != NULL)
+	stats->util = util_end(&util, trace, stats);
+
     /* As far as we know, this is a valid malloc package */
     return 1;
 }
@@ -693,78 +975,94 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
  *   package on the trace. Note that our implementation of mem_sbrk() 
  *   doesn't allow the students to decrement the brk pointer, so brk
  *   is always the high water mark of the heap. 
- *   
+ *
+ *   If stats is not NULL, also fill in the memory metrics that count 
+ *   pages rather than brk: the resident heap size, sampled RSS_SAMPLES 
+ *   times over the trace, and the utilization averaged over requests.
+ *   New payloads are then written once per page, as a program would, 
+ *   so that their pages count as resident.
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   stats_t *stats)
 {   
-    int i;
+    int i, end = 0;
     int index;
     int size, newsize, oldsize;
-    int max_total_size = 0;
-    int total_size = 0;
     char *p;
     char *newp, *oldp;
+    util_t util;
+    const traceop_t *op = NULL;
+
+    /* 
+     * Start from a heap with no page resident, so that the resident
+     * sizes are this run's and not those of the runs before it 
+     */
+    if (stats != NULL)
+	mem_reset_pages();
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
+    util_start(&util, trace);
+
+    for (i = 0;  i < trace->num_ops;  i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+	util_request(&util, i, stats);
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+        switch (op->type) {
 
         case ALLOC: /* mm_alloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
+	    TRACE_NEED(trace, index);
 
 	    if ((p = mm_malloc(size)) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
+	    if (stats != NULL)
+		touch_pages(p, size);
 	    
 	    /* Remember region and size */
-	    trace->blocks[index] = p;
-	    trace->block_sizes[index] = size;
+	    trace->blocks[index].p = p;
+	    trace->blocks[index].size = size;
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
-	    total_size += size;
-	    
-	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    util_add(&util, size);
 	    break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
-	    oldsize = trace->block_sizes[index];
+	    index = op->index;
+	    newsize = op->size;
+	    TRACE_NEED(trace, index);
+	    oldsize = trace->blocks[index].size;
 
-	    oldp = trace->blocks[index];
+	    oldp = trace->blocks[index].p;
 	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc failed in eval_mm_util");
+	    if (stats != NULL && newsize > oldsize)
+		touch_pages(newp + oldsize, newsize - oldsize);
 
 	    /* Remember region and size */
-	    trace->blocks[index] = newp;
-	    trace->block_sizes[index] = newsize;
+	    trace->blocks[index].p = newp;
+	    trace->blocks[index].size = newsize;
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
-	    total_size += (newsize - oldsize);
-	    
-	    /* Update statistics */
-	    max_total_size = (total_size > max_total_size) ?
-		total_size : max_total_size;
+	    util_add(&util, newsize - oldsize);
 	    break;
 
         case FREE: /* mm_free */
-	    index = trace->ops[i].index;
-	    size = trace->block_sizes[index];
-	    p = trace->blocks[index];
+	    index = op->index;
+	    size = trace->blocks[index].size;
+	    p = trace->blocks[index].p;
 	    
 	    mm_free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
-	    total_size -= size;
+	    util_add(&util, -size);
 	    
 	    break;
 
@@ -774,9 +1072,175 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    return util_end(&util, trace, stats);
+}
+
+/*
+ * util_start - start measuring the utilization of a trace
+ */
+static void util_start(util_t *u, trace_t *trace)
+{
+    u->total_size = 0;
+    u->max_total_size = 0;
+    u->sample_every = trace->num_ops / RSS_SAMPLES + 1;
+    u->peak_resident = 0;
+    u->sum_util = 0;
+}
+
+/*
+ * util_request - account for the heap as request i starts: the 
+ *     utilization averaged over requests and, now and then, the 
+ *     resident size, if stats is not NULL
+ */
+static void util_request(util_t *u, int i, stats_t *stats)
+{
+    double resident;
+
+    if (stats != NULL) {
+	u->sum_util += (double)u->total_size / mem_heapsize();
+	if (i % u->sample_every == 0 && 
+	    (resident = mem_resident()) > u->peak_resident)
+	    u->peak_resident = resident;
+    }
+}
+
+/*
+ * util_add - account for delta more bytes of payload
+ */
+static void util_add(util_t *u, int delta)
+{
+    u->total_size += delta;
+    if (u->total_size > u->max_total_size)
+	u->max_total_size = u->total_size;
+}
+
+/*
+ * util_end - finish measuring the utilization of a trace, fill in the
+ *     memory metrics of stats if it is not NULL, and return the 
+ *     utilization
+ */
+static double util_end(util_t *u, trace_t *trace, stats_t *stats)
+{
+    if (stats != NULL) {
+	stats->resident = mem_resident();
+	if (stats->resident > u->peak_resident)
+	    u->peak_resident = stats->resident;
+	stats->peak_resident = u->peak_resident;
+	stats->heap = mem_heapsize();
+	stats->rss_util = (double)u->max_total_size / u->peak_resident;
+	stats->avg_util = u->sum_util / trace->num_ops;
+    }
+
+    return ((double)u->max_total_size / (double)mem_heapsize());
 }
 
+/*
+ * check_trace - check the mm package for correctness on a trace and,
+ *     if it passes, measure its utilization and memory use into stats
+ */
+static int check_trace(trace_t *trace, int tracenum, range_t **ranges,
+		       stats_t *stats)
+{
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    if (fuse_sample) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	return eval_mm_valid(trace, tracenum, ranges, stats);
+    }
+    if (!eval_mm_valid(trace, tracenum, ranges, NULL))
+	return 0;
+    if (verbose > 1)
+	printf("efficiency, ");
+    stats->util = eval_mm_util(trace, tracenum, ranges, stats);
+    return 1;
+}
+
+/*
+ * check_parallel - run check_trace on each of the n traces, jobs of 
+ *     them at a time (-j). Each runs in a child process, with its own 
+ *     copy of the heap and of the mm package, pinned to a CPU of its 
+ *     own while there are CPUs enough. The children leave their stats
+ *     in shared memory. A trace whose child dies counts as invalid.
+ */
+static void check_parallel(char **tracefiles, int n, stats_t *stats)
+{
+    int i, k, slot, status, running = 0;
+    int ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    pid_t pid, *pids;
+    int *slot_trace;
+    stats_t *shared;
+    range_t *ranges = NULL;
+    trace_t *trace;
+    cpu_set_t cpus;
+
+    shared = mmap(NULL, n * sizeof(stats_t), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+	unix_error("mmap error in check_parallel");
+    pids = (pid_t *)calloc(jobs, sizeof(pid_t));
+    slot_trace = (int *)calloc(jobs, sizeof(int));
+    if (pids == NULL || slot_trace == NULL)
+	unix_error("calloc error in check_parallel");
+    if (ncpus < 1)
+	ncpus = 1;
+
+    for (i = 0; i < n || running > 0; ) {
+
+	/* Start a child on the next trace if a slot is free */
+	if (i < n && running < jobs) {
+	    for (slot = 0; pids[slot] != 0; slot++)
+		;
+	    fflush(stdout);  /* or the child prints it again */
+	    if ((pid = fork()) < 0)
+		unix_error("fork error in check_parallel");
+	    if (pid == 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(slot % ncpus, &cpus);
+		sched_setaffinity(0, sizeof(cpus), &cpus); /* a hint only */
+		if (verbose > 1)
+		    verbose = 1;  /* no progress lines, they would interleave */
+		trace = read_trace(tracedir, tracefiles[i]);
+		shared[i].ops = trace->num_ops;
+		shared[i].valid = check_trace(trace, i, &ranges, &shared[i]);
+		fflush(stdout);
+		_exit(0);
+	    }
+	    pids[slot] = pid;
+	    slot_trace[slot] = i++;
+	    running++;
+	    continue;
+	}
+
+	/* Otherwise wait for one to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait error in check_parallel");
+	for (slot = 0; slot < jobs && pids[slot] != pid; slot++)
+	    ;
+	if (slot == jobs)
+	    continue;
+	pids[slot] = 0;
+	running--;
+	k = slot_trace[slot];
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	    shared[k].valid = 0;
+	    if (WIFSIGNALED(status))
+		printf("ERROR [trace %d]: checking it died of signal %d (%s)\n",
+		       k, WTERMSIG(status), strsignal(WTERMSIG(status)));
+	}
+	if (!shared[k].valid)
+	    errors++;
+	if (verbose > 1)
+	    printf("Checked trace %d (%s): %s\n", k, tracefiles[k],
+		   shared[k].valid ? "valid" : "not valid");
+    }
+
+    for (i = 0; i < n; i++)
+	stats[i] = shared[i];
+    munmap(shared, n * sizeof(stats_t));
+    free(pids);
+    free(slot_trace);
+}
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
@@ -784,45 +1248,224 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
-    /* Reset the heap and initialize the mm package */
+    /* 
+     * Start from the snapshot start_window took, if there is one, or 
+     * else reset the heap and initialize the mm package
+     */
+    if (mem_restore() == 0) {
+	replay(trace, window_first, window_last);
+	return;
+    }
     mem_reset_brk();
     if (mm_init() < 0) 
 	app_error("mm_init failed in eval_mm_speed");
+    replay(trace, 0, trace->num_ops);
+}
+
+/*
+ * start_window - run the ops before the -w window on a fresh heap, and
+ *    snapshot the heap and the blocks there, so that eval_mm_speed only 
+ *    has to run the window. Returns the number of ops in the window.
+ */
+static int start_window(trace_t *trace)
+{
+    static size_t blocks_len;
+
+    window_last = (window_end < trace->num_ops) ? window_end : trace->num_ops;
+    window_first = window_start;
+    if (window_first >= window_last)
+	app_error("ERROR: -w window starts past the end of the trace");
+
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in start_window");
+    replay(trace, 0, window_first);
+
+    /* The window must not move blocks, so make room for every id now */
+    if (trace->num_ids > 0)
+	TRACE_NEED(trace, trace->num_ids - 1);
+    blocks_len = trace->max_ids * sizeof(traceblock_t);
+    mem_snapshot_add(trace->blocks, &blocks_len);
+    if (mem_snapshot() < 0)
+	unix_error("mem_snapshot failed in start_window");
+    trace_keep(trace, window_first, window_last);  /* read it now, not while timed */
+    return window_last - window_first;
+}
+
+/*
+ * time_mm_speed - time the mm package on a trace, or on its -w window
+ *    without the time to restore the snapshot. The first write to each 
+ *    page in the window still pays for copying it from the snapshot.
+ */
+static double time_mm_speed(speed_t *params)
+{
+    double secs = fsecs(eval_mm_speed, params);
+
+    if (window_end >= 0) {
+	secs -= fsecs(eval_mm_restore, NULL);
+	if (secs < 1e-9)  /* within the noise of the measurement */
+	    secs = 1e-9;
+    }
+    return secs;
+}
+
+/*
+ * eval_mm_restore - restore the snapshot of the -w window and no more,
+ *    to time it
+ */
+static void eval_mm_restore(void *ptr)
+{
+    mem_restore();
+}
+
+/*
+ * replay - run ops [first, last) of the trace on the mm package, 
+ *    without any checks
+ */
+static void replay(trace_t *trace, int first, int last)
+{
+    int i, end = first, index, size, newsize;
+    char *p, *newp, *oldp, *block;
+    const traceop_t *op = NULL;
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
-        switch (trace->ops[i].type) {
+    for (i = first;  i < last;  i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+        switch (op->type) {
 
         case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
+            index = op->index;
+            size = op->size;
             if ((p = mm_malloc(size)) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
+	    TRACE_NEED(trace, index);
+            trace->blocks[index].p = p;
             break;
 
 	case REALLOC: /* mm_realloc */
-	    index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
+	    index = op->index;
+            newsize = op->size;
+	    TRACE_NEED(trace, index);
+	    oldp = trace->blocks[index].p;
             if ((newp = mm_realloc(oldp,newsize)) == NULL)
 		app_error("mm_realloc error in eval_mm_speed");
-            trace->blocks[index] = newp;
+            trace->blocks[index].p = newp;
             break;
 
         case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            block = trace->blocks[index];
+            index = op->index;
+            block = trace->blocks[index].p;
             mm_free(block);
             break;
 
 	default:
-	    app_error("Nonexistent request type in eval_mm_valid");
+	    app_error("Nonexistent request type in eval_mm_speed");
         }
+    }
+}
+
+/*
+ * sweep - Evaluate the mm package once per value of a tuning knob,
+ *    set with the function set, and print the average utilization and 
+ *    the throughput for each value. With -c, also print hardware 
+ *    counters per operation, taken over one extra speed run per trace.
+ */
+static void sweep(char *title, char *label, int *values, int num_values,
+		  void (*set)(int), char **tracefiles, int num_tracefiles)
+{
+    int i, j, k, numvalid;
+    double util, ops, secs;
+    long long counts[PERFCTR_N], totals[PERFCTR_N];
+    trace_t *trace;
+    range_t *ranges = NULL;
+    speed_t speed_params;
+    stats_t *stats;
+    int counters = hwcounters;
+
+    if (counters && perfctr_open() == 0) {
+	printf("Hardware counters unavailable: %s\n", strerror(errno));
+	counters = 0;
+    }
+
+    if ((stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t))) == NULL)
+	unix_error("calloc error in sweep");
+
+    printf("\n%s:\n", title);
+    printf("%6s%7s%8s%10s%6s", label, "util", "ops", "secs", "Kops");
+    if (counters)
+	printf("%9s%9s%9s%8s", "cyc/op", "insn/op", "llc/op", "stall%");
+    printf("\n");
+    for (k = 0; k < num_values; k++) {
+	set(values[k]);
+	util = ops = secs = 0;
+	numvalid = 0;
+	for (j = 0; j < PERFCTR_N; j++)
+	    totals[j] = 0;
+	if (jobs > 1)
+	    check_parallel(tracefiles, num_tracefiles, stats);
+	for (i = 0; i < num_tracefiles; i++) {
+	    if (jobs > 1 && !stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    if (jobs > 1 || check_trace(trace, i, &ranges, &stats[i])) {
+		util += stats[i].util;
+		speed_params.trace = trace;
+		speed_params.ranges = ranges;
+		ops += (window_end >= 0) ? start_window(trace) : trace->num_ops;
+		secs += time_mm_speed(&speed_params);
+		numvalid++;
+		if (counters) {
+		    perfctr_start();
+		    eval_mm_speed(&speed_params);
+		    perfctr_stop(counts);
+		    for (j = 0; j < PERFCTR_N; j++)
+			totals[j] = (counts[j] < 0 || totals[j] < 0) ? 
+			    -1 : totals[j] + counts[j];
+		}
+		mem_snapshot_free();
+	    }
+	    trace_free(trace);
+	}
+	if (numvalid < num_tracefiles) {
+	    printf("%6d%7s%8s%10s%6s\n", values[k], "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%6d%6.0f%%%8.0f%10.6f%6.0f", 
+	       values[k], 
+	       (util/num_tracefiles)*100.0, 
+	       ops, 
+	       secs, 
+	       (ops/1e3)/secs);
+	if (counters) {
+	    for (j = 0; j < PERFCTR_STALLS; j++) {
+		if (totals[j] < 0)
+		    printf("%9s", "-");
+		else
+		    printf("%9.1f", totals[j] / ops);
+	    }
+	    if (totals[PERFCTR_STALLS] < 0 || totals[PERFCTR_CYCLES] <= 0)
+		printf("%8s", "-");
+	    else
+		printf("%7.1f%%", 100.0 * totals[PERFCTR_STALLS] / 
+		       totals[PERFCTR_CYCLES]);
+	}
+	printf("\n");
+    }
+    free_ranges(&ranges);
+    free(stats);
+}
+
+/*
+ * set_hugepages - Rebuild the simulated heap with another page backing
+ */
+static void set_hugepages(int huge)
+{
+    mem_deinit();
+    mem_set_hugepages(huge);
+    mem_init();
 }
 
 /*
@@ -833,32 +1476,37 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace, int tracenum)
 {
-    int i, newsize;
+    int i, end = 0, newsize;
     char *p, *newp, *oldp;
+    const traceop_t *op = NULL;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0;  i < trace->num_ops;  i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+        switch (op->type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
+	    if ((p = malloc(op->size)) == NULL) {
 		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    TRACE_NEED(trace, op->index);
+	    trace->blocks[op->index].p = p;
 	    break;
 
 	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
+            newsize = op->size;
+	    TRACE_NEED(trace, op->index);
+	    oldp = trace->blocks[op->index].p;
 	    if ((newp = realloc(oldp, newsize)) == NULL) {
 		malloc_error(tracenum, i, "libc realloc failed");
 		unix_error("System message");
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    trace->blocks[op->index].p = newp;
 	    break;
 	    
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    free(trace->blocks[op->index].p);
 	    break;
 
 	default:
@@ -876,34 +1524,39 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, end = 0;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    const traceop_t *op = NULL;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    for (i = 0;  i < trace->num_ops;  i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+        switch (op->type) {
         case ALLOC: /* malloc */
-	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
+	    index = op->index;
+	    size = op->size;
 	    if ((p = malloc(size)) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
-	    trace->blocks[index] = p;
+	    TRACE_NEED(trace, index);
+	    trace->blocks[index].p = p;
 	    break;
 
 	case REALLOC: /* realloc */
-	    index = trace->ops[i].index;
-	    newsize = trace->ops[i].size;
-	    oldp = trace->blocks[index];
+	    index = op->index;
+	    newsize = op->size;
+	    TRACE_NEED(trace, index);
+	    oldp = trace->blocks[index].p;
 	    if ((newp = realloc(oldp, newsize)) == NULL)
 		unix_error("realloc failed in eval_libc_speed\n");
 	    
-	    trace->blocks[index] = newp;
+	    trace->blocks[index].p = newp;
 	    break;
 	    
         case FREE: /* free */
-	    index = trace->ops[i].index;
-	    block = trace->blocks[index];
+	    index = op->index;
+	    block = trace->blocks[index].p;
 	    free(block);
 	    break;
 	}
@@ -924,49 +1577,63 @@ static void printresults(int n, stats_t *stats)
     double secs = 0;
     double ops = 0;
     double util = 0;
+    double resident = 0;
 
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
-	   "trace", " valid", "util", "ops", "secs", "Kops");
+    printf("%5s%7s %5s%8s%8s%10s%6s\n", 
+	   "trace", " valid", "util", "resKB", "ops", "secs", "Kops");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%", 
 		   i,
 		   "yes",
-		   stats[i].util*100.0,
+		   stats[i].util*100.0);
+	    if (stats[i].resident > 0)
+		printf("%8.0f", stats[i].resident/1024);
+	    else
+		printf("%8s", "-");
+	    printf("%8.0f%10.6f%6.0f\n", 
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
+	    resident += stats[i].resident;
 	}
 	else {
-	    printf("%2d%10s%6s%8s%10s%6s\n", 
+	    printf("%2d%10s%6s%8s%8s%10s%6s\n", 
 		   i,
 		   "no",
 		   "-",
 		   "-",
 		   "-",
+		   "-",
 		   "-");
 	}
     }
 
     /* Print the aggregate results for the set of traces */
     if (errors == 0) {
-	printf("%12s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	printf("%12s%5.0f%%", 
 	       "Total       ",
-	       (util/n)*100.0,
+	       (util/n)*100.0);
+	if (resident > 0)
+	    printf("%8.0f", resident/1024);
+	else
+	    printf("%8s", "-");
+	printf("%8.0f%10.6f%6.0f\n", 
 	       ops, 
 	       secs,
 	       (ops/1e3)/secs);
     }
     else {
-	printf("%12s%6s%8s%10s%6s\n", 
+	printf("%12s%6s%8s%8s%10s%6s\n", 
 	       "Total       ",
 	       "-", 
 	       "-", 
 	       "-", 
+	       "-", 
 	       "-");
     }
 
@@ -999,19 +1666,121 @@ void malloc_error(int tracenum, int opnum, char *msg)
     printf("ERROR [trace %d, line %d]: %s\n", tracenum, LINENUM(opnum), msg);
 }
 
+/*
+ * touch_pages - write one byte in each page of [p, p+size)
+ */
+static void touch_pages(char *p, int size)
+{
+    int page = getpagesize();
+    int off;
+
+    for (off = 0; off < size; off += page - ((unsigned long)(p + off) % page))
+	p[off] = 0;
+}
+
+/*
+ * printmemory - prints the page-based memory metrics of the mm package:
+ *     utilization against brk, against the peak resident size, and 
+ *     averaged over the trace, then the heap size against the peak and
+ *     final resident sizes
+ */
+static void printmemory(int n, stats_t *stats)
+{
+    int i;
+
+    printf("%5s%7s%8s%8s%9s%9s%9s\n", 
+	   "trace", "util", "rssutil", "avgutil", "heapKB", "peakKB", "endKB");
+    for (i=0; i < n; i++) {
+	if (stats[i].valid)
+	    printf("%2d%9.0f%%%7.0f%%%7.0f%%%9.0f%9.0f%9.0f\n", 
+		   i,
+		   stats[i].util*100.0,
+		   stats[i].rss_util*100.0,
+		   stats[i].avg_util*100.0,
+		   stats[i].heap/1024,
+		   stats[i].peak_resident/1024,
+		   stats[i].resident/1024);
+	else
+	    printf("%2d%10s%8s%8s%9s%9s%9s\n", 
+		   i, "-", "-", "-", "-", "-", "-");
+    }
+}
+
+/*
+ * writeresults - write the mm results to outfile as comma-separated 
+ *     values, a header line, then one line per trace and a total line 
+ *     that also has the performance index. Fields of a trace that was
+ *     not valid are empty.
+ */
+static void writeresults(char *outfile, char **tracefiles, int n, 
+			 stats_t *stats, double perfindex)
+{
+    FILE *f;
+    int i;
+    double ops = 0, secs = 0, util = 0;
+
+    if ((f = fopen(outfile, "w")) == NULL)
+	unix_error("Could not create the -o file");
+    fprintf(f, "trace,valid,util,ops,secs,kops,heap_kb,peak_kb,end_kb,"
+	    "rss_util,avg_util,perfidx\n");
+    for (i = 0; i < n; i++) {
+	if (!stats[i].valid) {
+	    fprintf(f, "%s,0,,,,,,,,,,\n", tracefiles[i]);
+	    continue;
+	}
+	fprintf(f, "%s,1,%.4f,%.0f,%.6f,%.0f,%.0f,%.0f,%.0f,%.4f,%.4f,\n",
+		tracefiles[i], stats[i].util, stats[i].ops, stats[i].secs,
+		(stats[i].ops/1e3)/stats[i].secs, stats[i].heap/1024,
+		stats[i].peak_resident/1024, stats[i].resident/1024,
+		stats[i].rss_util, stats[i].avg_util);
+	ops += stats[i].ops;
+	secs += stats[i].secs;
+	util += stats[i].util;
+    }
+    if (errors == 0)
+	fprintf(f, "total,1,%.4f,%.0f,%.6f,%.0f,,,,,,%.0f\n", util/n, ops, secs,
+		(ops/1e3)/secs, perfindex);
+    else
+	fprintf(f, "total,0,,,,,,,,,,0\n");
+    if (fclose(f) != 0)
+	unix_error("Could not write the -o file");
+}
+
 /* 
  * usage - Explain the command line arguments
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValncsR] [-f <file>] [-F <n>] [-j <n>] [-t <dir>] [-o <file>] [-k <K>] [-d <D>] [-x <n>] [-m <size>] [-H <n>] [-p <file>] [-w <start:end>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-c         Report hardware counters for prefetch distances.\n");
+    fprintf(stderr, "\t-d <D>     Prefetch D list nodes ahead (0 for none).\n");
+    fprintf(stderr, "\t           Repeat -d to compare speed per D.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <n>     Check validity and util in one pass, and all of\n");
+    fprintf(stderr, "\t           the payload of only one block id in n, then time\n");
+    fprintf(stderr, "\t           FUSED_RUNS runs instead of 10.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Check n traces at once, each in a process of its\n");
+    fprintf(stderr, "\t           own; the speed runs stay one at a time.\n");
+    fprintf(stderr, "\t-H <n>     Back the heap with huge pages, 1 for THP, 2 for hugetlb,\n");
+    fprintf(stderr, "\t           and compare throughput with base pages.\n");
+    fprintf(stderr, "\t-k <K>     Fit search examines at most K blocks per list.\n");
+    fprintf(stderr, "\t           Repeat -k to compare util and speed per K.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <size>  Let the heap grow to size bytes (K, M, G suffixes).\n");
+    fprintf(stderr, "\t           The default is MAX_HEAP, or MM_MAX_HEAP if set.\n");
+    fprintf(stderr, "\t-n         Search the free lists of mm.c instead of its index.\n");
+    fprintf(stderr, "\t-o <file>  Write the results to <file> as CSV.\n");
+    fprintf(stderr, "\t-p <file>  Keep the heap in <file>, mapped shared.\n");
+    fprintf(stderr, "\t-R         Fill each block with a random pattern of its own.\n");
+    fprintf(stderr, "\t-s         Stream the traces from disk instead of reading them in.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
+    fprintf(stderr, "\t-w <s:e>   Time only ops s to e-1 of each trace, from a snapshot\n");
+    fprintf(stderr, "\t           of the heap after op s-1.\n");
+    fprintf(stderr, "\t-x <n>     Run n interleaved copies of each trace.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
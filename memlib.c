@@ -2,6 +2,41 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            The heap is a range of virtual memory reserved once with
+ *            mmap(PROT_NONE). Pages are committed (made readable and 
+ *            writable) in chunks as mem_sbrk moves the brk past them, so
+ *            startup is cheap and the resident size follows the heap. 
+ *            The size of the range is MAX_HEAP by default, and can be 
+ *            changed at run time with mem_set_maxheap or the MM_MAX_HEAP
+ *            environment variable.
+ *
+ *            mem_release gives the pages of unused parts of the heap back
+ *            to the OS, and mem_resident counts the pages still backed.
+ *
+ *            The range can be backed by 2 MB pages (mem_set_hugepages or
+ *            MM_HUGEPAGES): transparent huge pages on a 2 MB aligned 
+ *            range, or explicit MAP_HUGETLB pages from the kernel's pool.
+ *
+ *            The heap can also live in a file (mem_set_file or MM_HEAP_FILE)
+ *            or a POSIX shared memory object (mem_set_shared or MM_HEAP_SHM),
+ *            mapped MAP_SHARED behind a header page that records the brk. 
+ *            A later process that maps the same file finds the heap as it
+ *            was left, and processes that map it at the same time share it,
+ *            at whatever address each mapping lands. The rest of the header
+ *            page is left to the allocator for its own shared state 
+ *            (mem_shared_area); callers serialize mem_sbrk between them.
+ *            Each process holds a flock on the file while it maps it. 
+ *            The first one holds it exclusively until it has set the
+ *            heap up (mem_shared_ready), and the others wait for it.
+ *
+ *            mem_snapshot saves the heap, its brk and any state the caller
+ *            registered with mem_snapshot_add, and mem_restore puts them 
+ *            back as often as needed. The heap bytes go to an unlinked 
+ *            shared memory object; a heap of base pages is restored by 
+ *            mapping it copy-on-write over the heap, so a restore costs
+ *            only the pages that are touched afterwards. Other heaps are
+ *            restored by copying.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,28 +45,139 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#define COMMIT_CHUNK (1<<20)    /* commit heap pages 1 MB at a time */
+#define HUGE_PAGE    (2*(1<<20))  /* size of an x86 huge page */
+#define FILE_MAGIC   0x6d6d6870   /* "mmhp", first word of a heap file */
+#define FILE_VERSION 1
+
+/* The header page of a heap file */
+typedef struct {
+    unsigned int magic;           /* FILE_MAGIC once the file is set up */
+    unsigned int version;         /* FILE_VERSION */
+    unsigned long long max_heap;  /* size of the heap that follows */
+    unsigned long long brk;       /* heap size, kept up to date by mem_sbrk */
+} mem_file_t;
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit;     /* end of the committed pages */
+static size_t mem_max_heap = 0; /* size of the reserved range, 0 if unset */
+static int mem_huge = -1;       /* MEM_HUGE_xxx backing, -1 if unset */
+static size_t mem_page = 0;     /* effective page size of the heap */
+static char *mem_map;           /* whole mapping, for munmap */
+static size_t mem_map_len;
+static unsigned long *mem_released; /* one bit per base page given back by mem_release, but not for a heap file */
+static char *mem_path = NULL;   /* heap file, NULL for anonymous memory */
+static int mem_shm = 0;         /* 1 if mem_path names a shared memory object */
+static int mem_fd = -1;
+static mem_file_t *mem_file;    /* header page of the heap file */
+static int mem_alone = 0;       /* 1 if no other process mapped the file when we did... */
+static int mem_setting_up = 0;  /* ... and we still keep the others out */
+
+/* The last snapshot, and what to save along with the heap */
+#define SNAP_AREAS 8
+static struct {
+    void *p;                 /* area outside the heap */
+    const size_t *len;       /* its size, read when the snapshot is taken */
+    size_t saved;            /* bytes saved */
+} mem_areas[SNAP_AREAS];
+static int mem_num_areas = 0;
+static int mem_snap_fd = -1;         /* heap bytes, at their heap offsets */
+static int mem_snap_mapped = 0;      /* 1 while the heap is mapped over a snapshot */
+static size_t mem_snap_brk;          /* heap size at the snapshot */
+static unsigned long *mem_snap_released; /* mem_released at the snapshot */
+static char *mem_snap_areas;         /* the registered areas, back to back */
+
+#define LONG_BITS (8 * sizeof(unsigned long))
+#define RELEASED_BYTES ((mem_max_heap / getpagesize() / LONG_BITS + 1) * sizeof(unsigned long))
+
+/* Dropping the pages of a file mapping must also free them in the file */
+#ifdef MADV_REMOVE
+#define MEM_DISCARD (mem_fd >= 0 ? MADV_REMOVE : MADV_DONTNEED)
+#else
+#define MEM_DISCARD MADV_DONTNEED
+#endif
+
+static char *mem_reserve(size_t len, int huge);
+static char *mem_map_file(void);
+static void mem_init_released(void);
+static size_t mem_next_run(size_t i, size_t n);
+static int mem_zero_page(char *p);
+static int mem_private_pages(char *p, size_t len, size_t *bytes);
+static int mem_copy(int fd, char *p, size_t len, off_t off, int save);
+static void mem_snapshot_free_data(void);
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    char *env;
+
+    /* The command line wins over the environment, which wins over config.h */
+    if (mem_max_heap == 0 && (env = getenv("MM_MAX_HEAP")) != NULL)
+	mem_max_heap = mem_parse_size(env);
+    if (mem_max_heap == 0)
+	mem_max_heap = MAX_HEAP;
+
+    if (mem_huge < 0 && (env = getenv("MM_HUGEPAGES")) != NULL)
+	mem_huge = atoi(env);
+    if (mem_huge < 0)
+	mem_huge = MEM_HUGE_OFF;
+
+    if (mem_path == NULL && (env = getenv("MM_HEAP_FILE")) != NULL)
+	mem_path = env;
+    if (mem_path == NULL && (env = getenv("MM_HEAP_SHM")) != NULL) {
+	mem_path = env;
+	mem_shm = 1;
+    }
+    if (mem_path != NULL) {
+	mem_start_brk = mem_map_file();
+	mem_init_released();
+	return;
+    }
+
+    /* reserve the address range we will use to model the available VM */
+    mem_page = (mem_huge == MEM_HUGE_OFF) ? (size_t)getpagesize() : HUGE_PAGE;
+    mem_max_heap = (mem_max_heap + mem_page - 1) & ~(mem_page - 1);
+    mem_start_brk = mem_reserve(mem_max_heap, mem_huge);
+    if (mem_start_brk == NULL && mem_huge == MEM_HUGE_TLB) {
+	fprintf(stderr, "mem_init_vm: no MAP_HUGETLB pages (%s), "
+		"using transparent huge pages\n", strerror(errno));
+	mem_huge = MEM_HUGE_THP;
+	mem_start_brk = mem_reserve(mem_max_heap, mem_huge);
+    }
+    if (mem_start_brk == NULL) {
+	fprintf(stderr, "mem_init_vm: mmap error reserving %lu bytes: %s\n", 
+		(unsigned long)mem_max_heap, strerror(errno));
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_addr = mem_start_brk + mem_max_heap;  /* max legal heap address */
+    mem_brk = mem_start_brk;                      /* heap is empty initially */
+    mem_commit = mem_start_brk;                   /* and nothing committed */
+    mem_init_released();
+}
+
+/*
+ * mem_init_released - allocate the bitmap of released pages
+ */
+static void mem_init_released(void)
+{
+    mem_released = calloc(RELEASED_BYTES, 1);
+    if (mem_released == NULL) {
+	fprintf(stderr, "mem_init_vm: calloc error\n");
+	exit(1);
+    }
 }
 
 /* 
@@ -39,15 +185,179 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_snapshot_free();
+    munmap(mem_map, mem_map_len);
+    free(mem_released);
+    if (mem_fd >= 0) {
+	close(mem_fd);
+	mem_fd = -1;
+	mem_file = NULL;
+	mem_alone = mem_setting_up = 0;
+    }
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_map_file - map the heap file, setting it up if it is new or empty.
+ *    If it already holds a heap, the brk and the size of the heap are 
+ *    taken from its header; any other file is left alone, and is an
+ *    error. Returns the start of the heap.
+ */
+static char *mem_map_file(void)
+{
+    size_t hdr_len = (size_t)getpagesize();
+    mem_file_t hdr;
+    struct stat st;
+    char *p;
+    int valid;
+
+    if (mem_shm)
+	mem_fd = shm_open(mem_path, O_RDWR | O_CREAT, 0600);
+    else
+	mem_fd = open(mem_path, O_RDWR | O_CREAT, 0600);
+    if (mem_fd < 0) {
+	fprintf(stderr, "mem_init_vm: cannot open heap file %s: %s\n", 
+		mem_path, strerror(errno));
+	exit(1);
+    }
+
+    /*
+     * Every process that maps the file holds a shared lock on it, so one
+     * that gets an exclusive lock is the only one: it sets the heap up,
+     * and keeps the exclusive lock until mem_shared_ready. The others wait
+     * here for a shared lock, so they never see a heap half set up, and
+     * never set it up again.
+     */
+    mem_alone = mem_setting_up = (flock(mem_fd, LOCK_EX | LOCK_NB) == 0);
+    if ((!mem_alone && flock(mem_fd, LOCK_SH) < 0) || fstat(mem_fd, &st) < 0) {
+	fprintf(stderr, "mem_init_vm: cannot lock heap file %s: %s\n", 
+		mem_path, strerror(errno));
+	exit(1);
+    }
+    valid = (st.st_size >= (off_t)hdr_len &&
+	     pread(mem_fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	     hdr.magic == FILE_MAGIC && hdr.version == FILE_VERSION &&
+	     st.st_size >= (off_t)(hdr_len + hdr.max_heap) &&
+	     hdr.brk <= hdr.max_heap);
+    if (!valid && (st.st_size != 0 || !mem_alone)) {
+	fprintf(stderr, "mem_init_vm: %s is not a heap file\n", mem_path);
+	exit(1);
+    }
+    if (valid)
+	mem_max_heap = hdr.max_heap;
+    else {
+	mem_max_heap = (mem_max_heap + hdr_len - 1) & ~(hdr_len - 1);
+	if (ftruncate(mem_fd, hdr_len + mem_max_heap) < 0) {
+	    fprintf(stderr, "mem_init_vm: cannot size heap file %s: %s\n", 
+		    mem_path, strerror(errno));
+	    exit(1);
+	}
+    }
+
+    /* The file is sparse, so mapping all of it costs nothing up front */
+    p = mmap(NULL, hdr_len + mem_max_heap, PROT_READ | PROT_WRITE, 
+	     MAP_SHARED, mem_fd, 0);
+    if (p == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error on heap file %s: %s\n", 
+		mem_path, strerror(errno));
+	exit(1);
+    }
+    mem_map = p;
+    mem_map_len = hdr_len + mem_max_heap;
+    mem_file = (mem_file_t *)p;
+    if (!valid) {
+	mem_file->brk = 0;
+	mem_file->max_heap = mem_max_heap;
+	mem_file->version = FILE_VERSION;
+	mem_file->magic = FILE_MAGIC;
+    }
+
+    mem_huge = MEM_HUGE_OFF;
+    mem_page = hdr_len;
+    mem_max_addr = p + hdr_len + mem_max_heap;
+    mem_brk = p + hdr_len + mem_file->brk;
+    mem_commit = mem_max_addr;                    /* file pages are all usable */
+    return p + hdr_len;
+}
+
+/*
+ * mem_reserve - reserve len bytes of address space for the heap, with
+ *    the given MEM_HUGE_xxx backing. Returns NULL on failure.
+ */
+static char *mem_reserve(size_t len, int huge)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    char *p, *start;
+
+    if (huge == MEM_HUGE_TLB) {
+#ifdef MAP_HUGETLB
+	/* 
+	 * No MAP_NORESERVE: take the pages from the pool now, so that an
+	 * empty pool fails here rather than with SIGBUS on first touch.
+	 */
+	p = mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+		 -1, 0);
+	if (p == MAP_FAILED)
+	    return NULL;
+	mem_map = p;
+	mem_map_len = len;
+	return p;
+#else
+	errno = ENOSYS;
+	return NULL;
+#endif
+    }
+
+    if (huge == MEM_HUGE_OFF) {
+	if ((p = mmap(NULL, len, PROT_NONE, flags, -1, 0)) == MAP_FAILED)
+	    return NULL;
+	mem_map = p;
+	mem_map_len = len;
+	return p;
+    }
+
+    /* 
+     * Transparent huge pages: the kernel only uses a huge page for a
+     * 2 MB aligned piece of the range, so over-reserve by one huge page,
+     * align the start and give back what sticks out at either end.
+     */
+    if ((p = mmap(NULL, len + HUGE_PAGE, PROT_NONE, flags, -1, 0)) == MAP_FAILED)
+	return NULL;
+    start = (char *)(((unsigned long)p + HUGE_PAGE - 1) & 
+		     ~(unsigned long)(HUGE_PAGE - 1));
+    if (start > p)
+	munmap(p, start - p);
+    if (start + len < p + len + HUGE_PAGE)
+	munmap(start + len, p + len + HUGE_PAGE - (start + len));
+#ifdef MADV_HUGEPAGE
+    if (madvise(start, len, MADV_HUGEPAGE) < 0)
+	fprintf(stderr, "mem_init_vm: madvise(MADV_HUGEPAGE) failed: %s\n",
+		strerror(errno));
+#endif
+    mem_map = start;
+    mem_map_len = len;
+    return start;
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap.
+ *    Committed pages stay committed, so the next run over the same 
+ *    heap does not pay for the page faults again.
  */
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    if (mem_file != NULL)
+	mem_file->brk = 0;
+}
+
+/*
+ * mem_reset_pages - give every committed page back to the OS, so that
+ *    the next run starts with no resident page. The pages stay committed.
+ */
+void mem_reset_pages()
+{
+    madvise(mem_start_brk, mem_commit - mem_start_brk, MEM_DISCARD);
+    memset(mem_released, 0, RELEASED_BYTES);
 }
 
 /* 
@@ -57,17 +367,159 @@ void mem_reset_brk()
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk;
+    char *commit;
+    size_t chunk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (mem_file != NULL)        /* another process may have moved it */
+	mem_brk = mem_start_brk + mem_file->brk;
+    old_brk = mem_brk;
+
+    if ( (incr < 0) || (incr > mem_max_addr - mem_brk)) {
 	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory "
+		"(max heap %lu bytes, see MM_MAX_HEAP)...\n", 
+		(unsigned long)mem_max_heap);
 	return (void *)-1;
     }
+
+    /* Commit the pages the new brk reaches, a chunk at a time */
+    if (mem_brk + incr > mem_commit) {
+	chunk = (mem_page > COMMIT_CHUNK) ? mem_page : COMMIT_CHUNK;
+	commit = mem_start_brk + 
+	    ((mem_brk + incr - mem_start_brk + chunk - 1) & ~(chunk - 1));
+	if (commit > mem_max_addr)
+	    commit = mem_max_addr;
+	if (mprotect(mem_commit, commit - mem_commit, 
+		     PROT_READ | PROT_WRITE) < 0) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit "
+		    "pages: %s\n", strerror(errno));
+	    return (void *)-1;
+	}
+	mem_commit = commit;
+    }
+
     mem_brk += incr;
+    if (mem_file != NULL)
+	mem_file->brk = mem_brk - mem_start_brk;
     return (void *)old_brk;
 }
 
+/*
+ * mem_set_maxheap - set the size of the heap range, before mem_init
+ */
+void mem_set_maxheap(size_t bytes)
+{
+    mem_max_heap = bytes;
+}
+
+/*
+ * mem_set_file - keep the heap in the file at path, before mem_init
+ */
+void mem_set_file(const char *path)
+{
+    mem_path = (char *)path;
+    mem_shm = 0;
+}
+
+/*
+ * mem_set_shared - keep the heap in the POSIX shared memory object name
+ *    (such as "/myheap"), before mem_init
+ */
+void mem_set_shared(const char *name)
+{
+    mem_path = (char *)name;
+    mem_shm = 1;
+}
+
+/*
+ * mem_shared_area - returns the part of the header page of a heap file
+ *    that the allocator may use, and its size in *len. NULL if the heap
+ *    is not in a file.
+ */
+void *mem_shared_area(size_t *len)
+{
+    if (mem_file == NULL)
+	return NULL;
+    *len = (size_t)getpagesize() - sizeof(mem_file_t);
+    return (char *)mem_file + sizeof(mem_file_t);
+}
+
+/*
+ * mem_shared_alone - returns 1 if the heap is in a file that no other
+ *    process had mapped when this one mapped it. Only such a process
+ *    may set up the allocator's shared state; it must then call
+ *    mem_shared_ready to let the others in.
+ */
+int mem_shared_alone(void)
+{
+    return mem_file != NULL && mem_alone;
+}
+
+/*
+ * mem_shared_ready - let the other processes waiting to map the heap
+ *    file in, once it is set up
+ */
+void mem_shared_ready(void)
+{
+    if (mem_file != NULL && mem_setting_up) {
+	flock(mem_fd, LOCK_SH);
+	mem_setting_up = 0;
+    }
+}
+
+/*
+ * mem_set_hugepages - choose the page backing of the heap (MEM_HUGE_xxx),
+ *    before mem_init
+ */
+void mem_set_hugepages(int huge)
+{
+    mem_huge = huge;
+}
+
+/*
+ * mem_hugepages - return the page backing in use, which is THP if 
+ *    MAP_HUGETLB was asked for but the kernel had no pages for us
+ */
+int mem_hugepages()
+{
+    return mem_huge;
+}
+
+/*
+ * mem_maxheap - return the largest size the heap can grow to
+ */
+size_t mem_maxheap()
+{
+    return (size_t)(mem_max_addr - mem_start_brk);
+}
+
+/*
+ * mem_parse_size - parse a byte count with an optional K, M or G 
+ *    suffix ("64M"). Returns 0 if the string is not a valid size.
+ */
+size_t mem_parse_size(const char *s)
+{
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'g': case 'G':
+	n <<= 10;
+	/* fall through */
+    case 'm': case 'M':
+	n <<= 10;
+	/* fall through */
+    case 'k': case 'K':
+	n <<= 10;
+	end++;
+	break;
+    }
+    if (end == s || *end != '\0' || n != (size_t)n)
+	return 0;
+    return (size_t)n;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -81,6 +533,8 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
+    if (mem_file != NULL)
+	mem_brk = mem_start_brk + mem_file->brk;
     return (void *)(mem_brk - 1);
 }
 
@@ -89,13 +543,368 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
+    if (mem_file != NULL)
+	mem_brk = mem_start_brk + mem_file->brk;
     return (size_t)(mem_brk - mem_start_brk);
 }
 
 /*
- * mem_pagesize() - returns the page size of the system
+ * mem_pagesize() - returns the page size backing the heap: the page 
+ *    size of the system, or the huge page size
  */
 size_t mem_pagesize()
 {
-    return (size_t)getpagesize();
+    return mem_page ? mem_page : (size_t)getpagesize();
+}
+
+/*
+ * mem_release - give the pages lying wholly inside [lo, lo+len) back to
+ *    the OS. They stay committed and read back as zeros, or as they were
+ *    at the snapshot while the heap is mapped over one (mem_restore). 
+ *    Returns the number of bytes in those pages.
+ *
+ *    MADV_FREE would be cheaper, but the kernel only takes those pages 
+ *    under memory pressure, so they would still count as resident.
+ */
+size_t mem_release(void *lo, size_t len)
+{
+    size_t page = mem_pagesize();
+    char *start = (char *)(((unsigned long)lo + page - 1) & ~(page - 1));
+    char *end = (char *)(((unsigned long)lo + len) & ~(page - 1));
+    size_t first, last, i;
+    int fresh = 0;
+
+    if (end <= start)
+	return 0;
+
+    /* 
+     * Only call the kernel if some of the pages are still backed. The 
+     * bitmap is our own, so it cannot tell for a heap file what the 
+     * other processes mapping it have done with the pages since.
+     */
+    if (mem_file != NULL)
+	return (madvise(start, end - start, MEM_DISCARD) < 0) ? 0 : (size_t)(end - start);
+    first = (start - mem_start_brk) / getpagesize();
+    last = (end - mem_start_brk) / getpagesize();
+    for (i = first; i < last; i++) {
+	if (!(mem_released[i / LONG_BITS] & (1UL << (i % LONG_BITS)))) {
+	    fresh = 1;
+	    mem_released[i / LONG_BITS] |= 1UL << (i % LONG_BITS);
+	}
+    }
+    if (fresh && madvise(start, end - start, MEM_DISCARD) < 0) {
+	for (i = first; i < last; i++)
+	    mem_released[i / LONG_BITS] &= ~(1UL << (i % LONG_BITS));
+	return 0;
+    }
+    return (size_t)(end - start);
+}
+
+/*
+ * mem_populate - fault in the pages of [lo, lo+len) that mem_release
+ *    gave back, ahead of use and in one call where the kernel supports it.
+ *    Does nothing for a heap file: which of its pages are backed is not
+ *    known here, and they fault in from the file as they are used.
+ */
+void mem_populate(void *lo, size_t len)
+{
+    size_t page = (size_t)getpagesize();
+    size_t first, last, i, lo_page = 0, hi_page = 0;
+    char *p, *end;
+    int found = 0;
+
+    if (len == 0 || mem_file != NULL)
+	return;
+    first = ((char *)lo - mem_start_brk) / page;
+    last = ((char *)lo + len - 1 - mem_start_brk) / page + 1;
+    for (i = first; i < last; i++) {
+	if (mem_released[i / LONG_BITS] & (1UL << (i % LONG_BITS))) {
+	    mem_released[i / LONG_BITS] &= ~(1UL << (i % LONG_BITS));
+	    if (!found)
+		lo_page = i;
+	    hi_page = i + 1;
+	    found = 1;
+	}
+    }
+    if (!found)
+	return;
+
+    p = mem_start_brk + lo_page * page;
+    end = mem_start_brk + hi_page * page;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(p, end - p, MADV_POPULATE_WRITE) == 0)
+	return;
+#endif
+    /*
+     * Writing back what we read is harmless only where nothing else can
+     * write at the same time. The caller owns [lo, lo+len), placing it
+     * under the allocator lock if there are threads, and a heap file 
+     * never gets here, so that is the pages lying wholly inside it. The
+     * pages at its ends may hold other threads' blocks, and are left to
+     * fault in when used.
+     */
+    if (p < (char *)lo)
+	p += page;
+    if (end > (char *)lo + len)
+	end -= page;
+    for (; p < end; p += page)
+	*(volatile char *)p = *(volatile char *)p;
+}
+
+/*
+ * mem_resident - returns the number of heap bytes backed by physical pages.
+ *    While the heap is mapped over a snapshot, the pages it still shares
+ *    with the snapshot are the snapshot's and are left out.
+ */
+size_t mem_resident()
+{
+    size_t page = (size_t)getpagesize();
+    size_t len = (mem_heapsize() + page - 1) & ~(page - 1);
+    size_t i, resident = 0;
+    unsigned char *vec;
+
+    if (len == 0)
+	return 0;
+    if (mem_snap_mapped && mem_private_pages(mem_start_brk, len, &resident) == 0)
+	return resident;
+    if ((vec = malloc(len / page)) == NULL)
+	return 0;
+    if (mincore(mem_start_brk, len, vec) == 0) {
+	for (i = 0; i < len / page; i++)
+	    if (vec[i] & 1)
+		resident += page;
+    }
+    free(vec);
+    return resident;
+}
+
+/*
+ * mem_private_pages - set *bytes to the bytes of [p, p+len) in pages that
+ *    are present and our own: not shared with the file mapped there. 
+ *    mincore cannot tell those apart, so this reads /proc/self/pagemap.
+ *    Returns 0, or -1 if it cannot be read.
+ */
+static int mem_private_pages(char *p, size_t len, size_t *bytes)
+{
+    size_t page = (size_t)getpagesize();
+    size_t i, j, n = len / page, want;
+    unsigned long long entry[512];   /* bit 63: present, bit 61: file page */
+    ssize_t got;
+    int fd;
+
+    if ((fd = open("/proc/self/pagemap", O_RDONLY)) < 0)
+	return -1;
+    *bytes = 0;
+    for (i = 0; i < n; i += want) {
+	want = (n - i < 512) ? n - i : 512;
+	got = pread(fd, entry, want * sizeof(entry[0]), 
+		    (off_t)(((unsigned long)p / page + i) * sizeof(entry[0])));
+	if (got != (ssize_t)(want * sizeof(entry[0]))) {
+	    close(fd);
+	    return -1;
+	}
+	for (j = 0; j < want; j++)
+	    if ((entry[j] >> 63 & 1) && !(entry[j] >> 61 & 1))
+		*bytes += page;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * mem_snapshot_add - also save the len bytes at p with the heap, where
+ *    *len is read each time a snapshot is taken. For allocator state that
+ *    lives outside the heap, and for the caller's own. Registering p again
+ *    only updates its size.
+ */
+void mem_snapshot_add(void *p, const size_t *len)
+{
+    int i;
+
+    for (i = 0; i < mem_num_areas; i++) {
+	if (mem_areas[i].p == p) {
+	    mem_areas[i].len = len;
+	    return;
+	}
+    }
+    if (mem_num_areas == SNAP_AREAS) {
+	fprintf(stderr, "mem_snapshot_add: more than %d areas\n", SNAP_AREAS);
+	exit(1);
+    }
+    mem_areas[mem_num_areas].p = p;
+    mem_areas[mem_num_areas].len = len;
+    mem_num_areas++;
+}
+
+/*
+ * mem_snapshot - save the heap and the registered areas, replacing any
+ *    earlier snapshot. Returns 0, or -1 if they could not be saved.
+ */
+int mem_snapshot(void)
+{
+    size_t page = (size_t)getpagesize();
+    size_t len, total, i, n, end;
+    char name[64];
+    char *q;
+    int k;
+
+    mem_snapshot_free_data();
+    len = (mem_heapsize() + page - 1) & ~(page - 1);
+
+    /* An unlinked shared memory object: memory backed, and gone on exit */
+    sprintf(name, "/memlib-snap.%d", (int)getpid());
+    if ((mem_snap_fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+	return -1;
+    shm_unlink(name);
+    if (ftruncate(mem_snap_fd, len) < 0) {
+	mem_snapshot_free_data();
+	return -1;
+    }
+
+    /* Pages of zeros, released ones among them, stay holes in the object */
+    n = len / page;
+    for (i = 0; i < n; i = end) {
+	end = mem_next_run(i, n);
+	if (!mem_zero_page(mem_start_brk + i * page) && 
+	    mem_copy(mem_snap_fd, mem_start_brk + i * page, (end - i) * page, 
+		     (off_t)(i * page), 1) < 0) {
+	    mem_snapshot_free_data();
+	    return -1;
+	}
+    }
+    mem_snap_brk = mem_heapsize();
+
+    mem_snap_released = malloc(RELEASED_BYTES);
+    for (total = 0, k = 0; k < mem_num_areas; k++)
+	total += *mem_areas[k].len;
+    mem_snap_areas = malloc(total + 1);
+    if (mem_snap_released == NULL || mem_snap_areas == NULL) {
+	mem_snapshot_free_data();
+	return -1;
+    }
+    memcpy(mem_snap_released, mem_released, RELEASED_BYTES);
+    for (q = mem_snap_areas, k = 0; k < mem_num_areas; k++) {
+	mem_areas[k].saved = *mem_areas[k].len;
+	memcpy(q, mem_areas[k].p, mem_areas[k].saved);
+	q += mem_areas[k].saved;
+    }
+    return 0;
+}
+
+/*
+ * mem_restore - put the heap, its brk and the registered areas back as
+ *    they were at the last snapshot. Returns 0, or -1 if there is none.
+ */
+int mem_restore(void)
+{
+    size_t page = (size_t)getpagesize();
+    size_t len = (mem_snap_brk + page - 1) & ~(page - 1);
+    size_t i;
+    char *q;
+    int k;
+
+    if (mem_snap_fd < 0)
+	return -1;
+
+    /* 
+     * Map the snapshot privately over the heap: pages are shared with it
+     * until written. Huge pages and file heaps would lose their backing,
+     * so those are copied back instead, which leaves every page backed.
+     */
+    memcpy(mem_released, mem_snap_released, RELEASED_BYTES);
+    if (len > 0 && mem_huge == MEM_HUGE_OFF && mem_fd < 0 &&
+	mmap(mem_start_brk, len, PROT_READ | PROT_WRITE, 
+	     MAP_PRIVATE | MAP_FIXED, mem_snap_fd, 0) != MAP_FAILED)
+	mem_snap_mapped = 1;
+    else if (len > 0) {
+	if (mem_copy(mem_snap_fd, mem_start_brk, len, 0, 0) < 0)
+	    return -1;
+	for (i = 0; i < len / page; i++)
+	    mem_released[i / LONG_BITS] &= ~(1UL << (i % LONG_BITS));
+    }
+
+    mem_brk = mem_start_brk + mem_snap_brk;
+    if (mem_file != NULL)
+	mem_file->brk = mem_snap_brk;
+    for (q = mem_snap_areas, k = 0; k < mem_num_areas; k++) {
+	memcpy(mem_areas[k].p, q, mem_areas[k].saved);
+	q += mem_areas[k].saved;
+    }
+    return 0;
+}
+
+/*
+ * mem_snapshot_free - drop the snapshot and forget the registered areas.
+ *    A heap left mapped over the snapshot gets fresh anonymous pages back.
+ */
+void mem_snapshot_free(void)
+{
+    if (mem_snap_mapped)
+	mmap(mem_start_brk, mem_commit - mem_start_brk, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    mem_snap_mapped = 0;
+    mem_snapshot_free_data();
+    mem_num_areas = 0;
+}
+
+/*
+ * mem_snapshot_free_data - free what the last snapshot saved
+ */
+static void mem_snapshot_free_data(void)
+{
+    if (mem_snap_fd >= 0)
+	close(mem_snap_fd);
+    mem_snap_fd = -1;
+    free(mem_snap_released);
+    mem_snap_released = NULL;
+    free(mem_snap_areas);
+    mem_snap_areas = NULL;
+}
+
+/*
+ * mem_zero_page - returns 1 if the heap page at p holds only zeros.
+ *    Reading a page that was released does not back it again.
+ */
+static int mem_zero_page(char *p)
+{
+    unsigned long *w = (unsigned long *)p;
+    size_t i, n = (size_t)getpagesize() / sizeof(unsigned long);
+
+    for (i = 0; i < n; i++)
+	if (w[i] != 0)
+	    return 0;
+    return 1;
+}
+
+/*
+ * mem_next_run - returns the end of the run of heap pages from page i,
+ *    below n, that all hold only zeros or all hold data
+ */
+static size_t mem_next_run(size_t i, size_t n)
+{
+    size_t page = (size_t)getpagesize();
+    int zero = mem_zero_page(mem_start_brk + i * page);
+
+    for (i++; i < n && mem_zero_page(mem_start_brk + i * page) == zero; i++)
+	;
+    return i;
+}
+
+/*
+ * mem_copy - write len bytes at p to fd at offset off, or with save
+ *    clear, read them back. Returns 0, or -1 on an error.
+ */
+static int mem_copy(int fd, char *p, size_t len, off_t off, int save)
+{
+    ssize_t n;
+
+    while (len > 0) {
+	n = save ? pwrite(fd, p, len, off) : pread(fd, p, len, off);
+	if (n <= 0)
+	    return -1;
+	p += n;
+	off += n;
+	len -= n;
+    }
+    return 0;
 }
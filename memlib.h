@@ -4,8 +4,36 @@ void mem_init(void);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_reset_pages(void);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_release(void *lo, size_t len);
+void mem_populate(void *lo, size_t len);
+size_t mem_resident(void);
 
+void mem_set_maxheap(size_t bytes);  /* call before mem_init */
+size_t mem_maxheap(void);
+size_t mem_parse_size(const char *s);
+
+/* Page backing of the heap, for mem_set_hugepages and MM_HUGEPAGES */
+#define MEM_HUGE_OFF 0  /* base pages */
+#define MEM_HUGE_THP 1  /* transparent huge pages (MADV_HUGEPAGE) */
+#define MEM_HUGE_TLB 2  /* explicit huge pages (MAP_HUGETLB) */
+
+void mem_set_hugepages(int huge);    /* call before mem_init */
+int mem_hugepages(void);
+
+/* Heap kept in a file or shared memory, see MM_HEAP_FILE and MM_HEAP_SHM */
+void mem_set_file(const char *path); /* call before mem_init */
+void mem_set_shared(const char *name);
+void *mem_shared_area(size_t *len);
+int mem_shared_alone(void);
+void mem_shared_ready(void);
+
+/* Snapshot of the heap, and of areas registered with it, to restore later */
+void mem_snapshot_add(void *p, const size_t *len);
+int mem_snapshot(void);
+int mem_restore(void);
+void mem_snapshot_free(void);
@@ -0,0 +1,136 @@
+/*
+ * mkclass.c - generates sizeclass.h, the size-class table shared by
+ *     mm_malloc, insert and removen in mm.c.
+ *
+ * Block sizes are multiples of 8 and at least 16 bytes. Small sizes,
+ * up to SC_EXACT_MAX, each get an exact class of their own. Above that
+ * every power of two [2^k, 2^(k+1)) is split into 2^subbits sub-classes
+ * of equal width, so that two blocks of the same class differ by at most
+ * a factor (1 + 2^-subbits). That ratio bounds the internal waste of
+ * taking the first block of a class. Everything at or above
+ * 2^SC_MAX_SHIFT falls in the last class.
+ *
+ * Lookup is constant time: a direct table for the exact classes, and
+ * the position of the highest bit plus the next subbits bits otherwise.
+ *
+ * usage: mkclass [subbits] > sizeclass.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SC_MIN_BLOCK   16         /* smallest block mm.c ever creates */
+#define SC_EXACT_MAX   128        /* largest size with an exact class */
+#define SC_EXACT_SHIFT 7          /* log2(SC_EXACT_MAX) */
+#define SC_MAX_SHIFT   20         /* sizes >= 1 MB share the last class */
+
+static int subbits = 2;           /* 4 sub-classes per power of two */
+
+static int exact[SC_EXACT_MAX/8 + 1];  /* class of size (8*i) */
+static int base[SC_MAX_SHIFT];         /* first class of octave k */
+static unsigned int class_min[1024];   /* smallest size in each class */
+static int num_classes;
+
+/*
+ * lookup - the constant-time lookup that mm.c performs with the tables
+ */
+static int lookup(unsigned int size)
+{
+    int k;
+
+    if (size <= SC_EXACT_MAX)
+        return exact[size >> 3];
+    k = 31 - __builtin_clz(size);
+    if (k >= SC_MAX_SHIFT)
+        return num_classes - 1;
+    return base[k] + ((size >> (k - subbits)) & ((1 << subbits) - 1));
+}
+
+int main(int argc, char **argv)
+{
+    int i, k, c;
+    unsigned int size, hi;
+    double waste;
+
+    if (argc > 1)
+        subbits = atoi(argv[1]);
+    if (subbits < 0 || subbits > 4) {
+        fprintf(stderr, "mkclass: subbits must be between 0 and 4\n");
+        exit(1);
+    }
+
+    /* Exact classes, one per multiple of 8 from SC_MIN_BLOCK up */
+    c = 0;
+    for (i = 0; i <= SC_EXACT_MAX/8; i++) {
+        if (8*i > SC_MIN_BLOCK)
+            c++;
+        exact[i] = c;
+        if (8*i >= SC_MIN_BLOCK)
+            class_min[c] = 8*i;
+    }
+    c++;
+
+    /* 2^subbits sub-classes per power of two above the exact range */
+    for (k = SC_EXACT_SHIFT; k < SC_MAX_SHIFT; k++) {
+        base[k] = c;
+        for (i = 0; i < (1 << subbits); i++) {
+            size = (1u << k) + ((unsigned int)i << (k - subbits));
+            class_min[c++] = (size <= SC_EXACT_MAX) ? SC_EXACT_MAX + 8 : size;
+        }
+    }
+    class_min[c++] = 1u << SC_MAX_SHIFT;
+    num_classes = c;
+
+    /* Check the fast lookup against the boundaries, size by size */
+    for (size = SC_MIN_BLOCK; size <= (2u << SC_MAX_SHIFT); size += 8) {
+        c = lookup(size);
+        if (size < class_min[c] ||
+            (c < num_classes - 1 && size >= class_min[c+1])) {
+            fprintf(stderr, "mkclass: size %u maps to class %d [%u, %u)\n",
+                    size, c, class_min[c], class_min[c+1]);
+            exit(1);
+        }
+    }
+
+    printf("/*\n * sizeclass.h - generated by mkclass %d, do not edit\n",
+           subbits);
+    printf(" *\n * %d exact classes up to %d bytes, %d sub-classes per power"
+           " of two,\n * last class for sizes >= %u bytes.\n */\n",
+           exact[SC_EXACT_MAX >> 3] + 1, SC_EXACT_MAX, 1 << subbits,
+           1u << SC_MAX_SHIFT);
+    printf("#ifndef __SIZECLASS_H_\n#define __SIZECLASS_H_\n\n");
+    printf("#define SC_NUM_CLASSES %d\n", num_classes);
+    printf("#define SC_EXACT_MAX   %d\n", SC_EXACT_MAX);
+    printf("#define SC_SUBBITS     %d\n", subbits);
+    printf("#define SC_MAX_SHIFT   %d\n\n", SC_MAX_SHIFT);
+
+    printf("/* class of each size up to SC_EXACT_MAX, indexed by size/8 */\n");
+    printf("static const unsigned char sc_exact[%d] = {", SC_EXACT_MAX/8 + 1);
+    for (i = 0; i <= SC_EXACT_MAX/8; i++)
+        printf("%s%s%d", i ? "," : "", (i % 16) ? " " : "\n    ", exact[i]);
+    printf("\n};\n\n");
+
+    printf("/* first class of each power of two 2^k, k < SC_MAX_SHIFT */\n");
+    printf("static const unsigned char sc_base[%d] = {", SC_MAX_SHIFT);
+    for (k = 0; k < SC_MAX_SHIFT; k++)
+        printf("%s%s%d", k ? "," : "", (k % 16) ? " " : "\n    ", base[k]);
+    printf("\n};\n\n");
+
+    printf("/* smallest block size of each class, and worst-case waste */\n");
+    printf("static const unsigned int sc_min[%d] = {\n", num_classes);
+    for (c = 0; c < num_classes; c++) {
+        hi = (c < num_classes - 1) ? class_min[c+1] - 8 : 0;
+        waste = hi ? (double)(hi - class_min[c]) / hi : 0;
+        printf("    %u,%*s/* %2d: %u", class_min[c],
+               (int)(10 - snprintf(NULL, 0, "%u", class_min[c])), "",
+               c, class_min[c]);
+        if (hi)
+            printf("..%u", hi);
+        else
+            printf(" and up");
+        if (waste > 0)
+            printf(", waste <= %.1f%%", 100.0 * waste);
+        printf(" */\n");
+    }
+    printf("};\n\n#endif /* __SIZECLASS_H_ */\n");
+    return 0;
+}
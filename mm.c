@@ -9,9 +9,15 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "sizeclass.h"                                                        // Generated by mkclass, see the Makefile
+#include "fitscan.h"
 
 /*********************************************************
  * NOTE TO STUDENTS: Before you do anything else, please
@@ -30,10 +36,12 @@ team_t team = {
     "ines.potier@polytechnique.edu"
 };
 
-/* single word (4) or double word (8) alignment */
+/* double word (8) alignment, or 16 as the x86-64 ABI asks of malloc (libmm.so) */
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 
 /*additional Macros defined*/
@@ -42,7 +50,27 @@ team_t team = {
 #define CHUNKSIZE (1<<12)                                                     // Default size of extension for extend_heap
 #define INIT (1<<6)                                                           // Default init size
 
-#define LISTSIZE  15                                                          // Size of segregated list 
+#ifndef FIT_LIMIT
+#define FIT_LIMIT 0                                                           // Default cutoff of the fit search (0 : no cutoff), see mm_set_fitlimit
+#endif
+
+#ifndef PREFETCH_DIST
+#define PREFETCH_DIST 1                                                       // Default number of list nodes prefetched ahead of a walk (0 : no prefetching), see mm_set_prefetch
+#endif
+
+#ifndef MM_INDEX
+#define MM_INDEX 1                                                            // Default of mm_set_index : 1 to find the free blocks of a private heap through the out-of-band index
+#endif
+
+#ifndef RELEASE_MIN
+#define RELEASE_MIN (1<<20)                                                   // Least size of a free block whose interior pages go back to the OS (0 : never)
+#endif
+
+#ifndef RELEASE_WAIT
+#define RELEASE_WAIT 64                                                       // Frees such a block must stay free through before its pages go back
+#endif
+
+#define LISTSIZE  SC_NUM_CLASSES                                              // Size of segregated list : one list per size class
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y)) 
 #define MIN(x, y) ((x) < (y) ? (x) : (y)) 
@@ -52,10 +80,12 @@ team_t team = {
 #define GET(p)            (*(unsigned int *)(p))                              // Read a word at address p 
 #define PUT(p, val) (*(unsigned int *)(p) = (val))                            // Write a word at address p
 
-#define SET_PTR(p, ptr) (*(unsigned int *)(p) = (unsigned int)(ptr))          // Store predecessor or successor for free blocks 
+#define SET_PTR(p, ptr) PUT(p, (ptr) ? (unsigned int)((char *)(ptr) - heap_base) : 0) // Store predecessor or successor for free blocks, as an offset from the start of the heap
 
 #define GET_SIZE(p)  (GET(p) & ~0x7)                                          //Get the size from header/footer
 #define GET_ALLOC(p) (GET(p) & 0x1)                                           //Get the allocated bit from header/footer
+#define RELEASED     0x2                                                      // Bit of a free block some of whose pages were given back to the OS
+#define GET_RELEASED(p) (GET(p) & RELEASED)
 
  
 #define HDRP(ptr) ((char *)(ptr) - WSIZE)                                     // Address of block's header
@@ -70,41 +100,206 @@ team_t team = {
 #define NEXT_FREEP(ptr) ((char *)(ptr) + WSIZE)
 
  
-#define PRED(ptr) (*(char **)(ptr))                                           // Address of free block's predecessor and successor on the segregated list
-#define SUCC(ptr) (*(char **)(NEXT_FREEP(ptr)))
+#define PRED(ptr) (GET(ptr) ? heap_base + GET(ptr) : NULL)                   // Address of free block's predecessor and successor on the segregated list
+#define SUCC(ptr) (GET(NEXT_FREEP(ptr)) ? heap_base + GET(NEXT_FREEP(ptr)) : NULL)
+
+#define PREFETCH(ptr) __builtin_prefetch(ptr)                                 // Start loading the cache line of ptr, never faults
+
+#define LIST_HEAD(n) (state->lists[n] ? heap_base + state->lists[n] : NULL)     // Read and write the head of segregated list n
+#define SET_HEAD(n, ptr) SET_PTR(&state->lists[n], ptr)
+
+#define MM_MAGIC 0x6d6d7374                                                   // "mmst", set once the heap and its state are laid out
+
+/* 
+ * State of the allocator that is not in the blocks. When the heap lives in a file or in shared memory (see memlib.c),
+ * it lives next to the heap, so that other processes mapping the same heap share the lists, and the lock keeps
+ * them from updating the heap at the same time. The lock is robust : a process dying with it held does not block
+ * the others, the next one rebuilds the lists from the block headers. The first process to map the heap file starts the
+ * lock and the lists afresh, since whatever the file holds was left by processes that are gone. The index (below) stays in the process,
+ * so such a heap always keeps its free blocks in the lists.
+ */
+
+typedef struct {
+    unsigned int magic;
+    pthread_mutex_t lock;                                                     // Process-shared, only used when shared is set
+    unsigned int lists[LISTSIZE];                                             // Head of each segregated list, as an offset from heap_base (0 : empty)
+    unsigned int release_blk;                                                 // Large free block waiting to give its pages back, as an offset (0 : none) ...
+    unsigned int release_freed;                                               // ... the part of it freed last, as an offset, and its size ...
+    unsigned int release_size;
+    unsigned int release_wait;                                                // ... and the frees left before it does, unless it is taken or merged first
+} mm_state;
+
+/* 
+ * Out-of-band free-block index : each class keeps the sizes of its free blocks in one dense array and their offsets
+ * in a parallel one, so the fit search is a vector scan over the sizes (fitscan.c) that never touches the blocks.
+ * The arrays live outside the heap, in an arena reserved once and reset by mm_init. A free block only records
+ * its slot in its first word. mm_init picks the index for a heap in the process, the lists for a heap in a file.
+ */
+
+#define INDEX_ARENA (64*(1<<20))                                              // Least virtual size of the arena holding the index arrays
+#define INDEX_INIT  64                                                        // Initial number of entries of an index array
+#define NO_SLOT     0xffffffff                                                // Slot of a free block the index had no room for
+
+#define GET_SLOT(ptr)       GET(ptr)                                          // Read and write the slot of a free block in its class array
+#define SET_SLOT(ptr, slot) PUT(ptr, slot)
 
-/*global variable : segregated list*/
+#define BLK_OFF(ptr) ((unsigned int)((char *)(ptr) - heap_base))               // Convert between block pointers and heap offsets
+#define OFF_BLK(off) (heap_base + (off))
 
-void *segregated_lists[LISTSIZE];
+typedef struct {
+    unsigned int *sizes;                                                      // Sizes of the free blocks of the class, in no particular order, as in their headers
+    unsigned int *offs;                                                       // Offsets of the same blocks from the start of the heap
+    unsigned int count;
+    unsigned int cap;
+} index_list;
+
+/*global variables : index of each class, and the arena it is carved from*/
+
+static index_list free_index[LISTSIZE];
+static char *index_arena = NULL;
+static size_t index_size;
+static size_t index_brk;
+
+static const size_t free_index_bytes = sizeof(free_index);                   // Sizes of the index state, for mem_snapshot_add
+static const size_t index_brk_bytes = sizeof(index_brk);
+
+static void *index_fit(index_list *list, size_t asize, int all_fit);
+
+/*global variables : allocator state, in the process or next to a shared heap*/
+
+static mm_state private_state;
+static mm_state *state = &private_state;
+static int shared = 0;                                                        // 1 : other processes or threads may use the heap, take the lock
+static int threaded = 0;                                                      // 1 : other threads may use the heap, take the lock too (see mm_set_threads)
+static int index_on = MM_INDEX;                                               // 1 : a private heap uses the index (see mm_set_index) ...
+static int use_index = 0;                                                     // ... and this one does
+static const size_t state_bytes = sizeof(mm_state) - offsetof(mm_state, lists); // Size of the list heads and the pending release, for mem_snapshot_add
+
+/*start of the heap : links between blocks are offsets from it, so they hold in 32 bits and survive the heap being mapped elsewhere*/
+
+static char *heap_base;
+
+/*number of candidates examined by the fit search in a list before it moves to the next class*/
+
+static int fit_limit = FIT_LIMIT;
+
+/*number of nodes a free-list walk prefetches ahead of the node it is looking at*/
+
+static int prefetch_dist = PREFETCH_DIST;
 
 
 //Functions
 
+static int init_heap(void);
 static void *extend_heap(size_t words);
 static void *place(void *bp, size_t asize);
 static void *coalesce(void *bp);
 static void insert(void *bp, size_t size);
 static void removen(void *bp);
+static inline int size_class(size_t size);
+static size_t page_pad(size_t extendsize);
+static void release(void *bp, char *freed, size_t size);
+static void defer_release(void *bp, char *freed, size_t size);
+static void release_pending(void);
+static int rebuild(void);
+static void init_lock(void);
+static void lock_heap(void);
+static inline void unlock_heap(void);
+static void list_insert(void *bp, size_t size);
+static void list_removen(void *bp);
+static inline char *walk_ahead(char *bp, int nodes);
+static void index_insert(void *bp, size_t size);
+static void index_removen(void *bp);
 
 
 
 /* Initializes the malloc, Return 0 if successful -1 if unsucessful */
 int mm_init(void){
+    
+    int ret = init_heap();
+    
+    mem_shared_ready();                                                          // A heap file we set up : let in the processes waiting to map it
+    return ret;
+}
+
+/* Sets up the heap and the lists, or finds those another process set up */
+static int init_heap(void){
    
     char *heap_listp;
     int numlist;
+    size_t area_size;
+    void *area;
    
+    heap_base = mem_heap_lo();
+
+    if ((area = mem_shared_area(&area_size)) != NULL && area_size >= sizeof(mm_state)) {   // The heap is in a file or shared memory : keep the state with it
+        state = area;
+        shared = 1;
+    }
+    else {
+        state = &private_state;
+        shared = 0;
+    }
+    mem_snapshot_add(state->lists, &state_bytes);                                // The list heads and the pending release go with the heap in a mem_snapshot
+    if (shared) {
+        if (!mem_shared_alone())                                                 // Set up by the process that mapped it first, which only let us in once done : its lock may be held, leave it be
+            return (state->magic == MM_MAGIC) ? 0 : -1;
+        state->magic = 0;                                                        // No other process has the heap mapped, so the lock and lists the file holds are
+        init_lock();                                                             // stale if anything (a crash, a copy of the file) : start both afresh, from the headers
+    }
+    if (state == &private_state) {                                               // A private heap used by several threads takes the same lock, in the process
+        shared = threaded;
+        if (shared)
+            init_lock();
+    }
+    state->release_blk = 0;
+
+// Initialize segregated lists, or the index for a heap only this process sees
+    
+    use_index = index_on && area == NULL;
+    if (use_index && index_arena == NULL) {                                      // Reserve the index arena on first use, pages are only backed once touched
+        index_size = MAX(INDEX_ARENA, mem_maxheap());                             // The arrays never need more than the heap itself
+        index_arena = mmap(NULL, index_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (index_arena == MAP_FAILED) {                                         // No room for it : the lists will do
+            index_arena = NULL;
+            use_index = 0;
+        }
+    }
+    
+    for (numlist = 0; numlist < LISTSIZE; numlist++) {
+        state->lists[numlist] = 0;
+    }
+    if (use_index) {
+        index_brk = 0;
+        mem_snapshot_add(free_index, &free_index_bytes);                         // The index goes with the heap in a mem_snapshot, the used part of the arena too
+        mem_snapshot_add(&index_brk, &index_brk_bytes);
+        mem_snapshot_add(index_arena, &index_brk);
+        
+        fitscan_init();                                                          // Pick the scan kernels for this CPU
+        
+        for (numlist = 0; numlist < LISTSIZE; numlist++) {
+            free_index[numlist].sizes = NULL;
+            free_index[numlist].offs = NULL;
+            free_index[numlist].count = 0;
+            free_index[numlist].cap = 0;
+        }
+    }
+
+// A heap is already there (a heap file left by an earlier process) : keep its blocks, start over if it is not one of ours
+
+    if (mem_heapsize() > 0) {
+        if (rebuild() == 0) {
+            state->magic = MM_MAGIC;
+            return 0;
+        }
+        mem_reset_brk();
+    }
+    
 // Check if there is enough space to create the heap
     
     if((heap_listp = mem_sbrk(4*WSIZE)) == NULL){                                
         return -1;
     }
-
-// Initialize segregated lists
-    
-    for (numlist = 0; numlist < LISTSIZE; numlist++) {
-        segregated_lists[numlist] = NULL;
-   }
     
     PUT(heap_listp, 0);                                                          /* Alignment block */
     PUT(heap_listp + (1 * WSIZE), PACK(DSIZE, 1));                               /* Prologue header */
@@ -117,9 +312,134 @@ int mm_init(void){
          return -1;
     }
 
+    state->magic = MM_MAGIC;
+    return 0;
+}
+
+/* Sets up the lock of a shared heap : process-shared, and robust so that a dead owner is reported to the next one */
+
+static void init_lock(void){
+    
+    pthread_mutexattr_t attr;
+    
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&state->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+/* Takes the lock of a shared heap. If its owner died, the lists may be half updated : rebuild them from the headers */
+
+static void lock_heap(void){
+    
+    int numlist;
+    
+    if (pthread_mutex_lock(&state->lock) == EOWNERDEAD) {
+        for (numlist = 0; numlist < LISTSIZE; numlist++)
+            state->lists[numlist] = 0;
+        state->release_blk = 0;
+        if (rebuild() < 0)                                                       // Headers half updated too : the free blocks are lost, allocation goes on past them
+            fprintf(stderr, "mm: a process died while updating the heap, its free blocks are lost\n");
+        pthread_mutex_consistent(&state->lock);
+    }
+}
+
+static inline void unlock_heap(void){
+    pthread_mutex_unlock(&state->lock);
+}
+
+/* Rebuilds the free lists (or the index) of an existing heap from its block headers. Checks the whole heap
+   first and returns -1 without touching anything if it is not a heap mm_init laid out */
+
+static int rebuild(void){
+    
+    char *end = heap_base + mem_heapsize();
+    char *bp;
+    size_t size;
+    
+    if (mem_heapsize() < 4*WSIZE ||
+        GET(heap_base + WSIZE) != PACK(DSIZE, 1) || GET(heap_base + 2*WSIZE) != PACK(DSIZE, 1))   // Prologue
+        return -1;
+    
+    for (bp = heap_base + 4*WSIZE; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+        if (size < 2*DSIZE || bp + size > end ||
+            (!GET_ALLOC(HDRP(bp)) && GET(FTRP(bp)) != GET(HDRP(bp))))                           // Free blocks have a matching footer
+            return -1;
+    }
+    if (HDRP(bp) != end - WSIZE || !GET_ALLOC(HDRP(bp)))                                          // Epilogue, last word of the heap
+        return -1;
+    
+    for (bp = heap_base + 4*WSIZE; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+        if (!GET_ALLOC(HDRP(bp)))
+            insert(bp, size);
+    }
+    
     return 0;
 }
 
+/* Padding that makes the heap end on a page boundary when the heap sits on huge pages, 
+   as long as it costs at most a sixteenth of the heap */
+
+static size_t page_pad(size_t extendsize)
+{
+    size_t pagesize = mem_pagesize();
+    size_t pad;
+    
+    if (pagesize <= CHUNKSIZE)                                                                  // Base pages : CHUNKSIZE already matches them
+        return 0;
+    
+    pad = (pagesize - (mem_heapsize() + extendsize) % pagesize) % pagesize;
+    return (pad <= mem_heapsize() / 16) ? pad : 0;                                              // Small heaps keep growing by CHUNKSIZE
+}
+
+/* Gives the interior pages of a large free block back to the OS, keeping the words the free lists and the footer use.
+   Once a block is marked, only the pages of a large block freed into it are given back again, so that small frees
+   next to it cost no system call */
+
+static void release(void *bp, char *freed, size_t size)
+{
+    char *lo = (char *)bp + DSIZE;                                                              // First two words : list links, or index slot
+    char *hi = FTRP(bp);
+    
+    if (GET_RELEASED(HDRP(bp))) {
+        if (size < RELEASE_MIN)
+            return;
+        lo = MAX(lo, freed);
+        hi = MIN(hi, freed + size);
+    }
+    
+    if (mem_release(lo, hi - lo) > 0) {
+        PUT(HDRP(bp), GET(HDRP(bp)) | RELEASED);
+        PUT(FTRP(bp), GET(FTRP(bp)) | RELEASED);
+    }
+}
+
+/* Holds the release of a large free block back until RELEASE_WAIT more frees : a block taken again soon after, as the
+   old copy of a growing realloc'ed block is, would pay a madvise and then the faults to get its pages back.
+   removen drops the block from the wait, and only one block waits : the one before goes back now */
+
+static void defer_release(void *bp, char *freed, size_t size)
+{
+    if (GET_RELEASED(HDRP(bp)) && size < RELEASE_MIN)                                           // release would do nothing
+        return;
+    release_pending();
+    state->release_blk = (char *)bp - heap_base;
+    state->release_freed = freed - heap_base;
+    state->release_size = size;
+    state->release_wait = RELEASE_WAIT;
+}
+
+/* Gives back the pages of the block waiting in defer_release, if there is one */
+
+static void release_pending(void)
+{
+    if (state->release_blk) {
+        release(heap_base + state->release_blk, heap_base + state->release_freed, state->release_size);
+        state->release_blk = 0;
+    }
+}
+
 /* Allocates a block with at least the specified size of payload */
 
 void *mm_malloc(size_t size)
@@ -137,37 +457,55 @@ void *mm_malloc(size_t size)
     if (asize <= 2*DSIZE){                                                            // Each created block has a minimum size of 2*DSIZE
        asize= 2*DSIZE;
     }
-  
-    int numlist = 0; 
     
-    size_t ssize = asize;
-   
+    if (shared)
+        lock_heap();
+  
+    int numlist = size_class(asize);                                                                      // Search for an adapted free block in segregated list
+    int candidates = fit_limit;                                                                           // Candidates left before giving up on this class (unbounded if 0)
+    char *ahead;                                                                                          // Node prefetch_dist steps ahead of bp, already on its way to the cache
     
-    while (numlist < LISTSIZE) {                                                                          // Search for an adapted free block in segregated list
-        if ((numlist == LISTSIZE - 1) || ((ssize <= 1) && (segregated_lists[numlist] != NULL))) {
-            bp = segregated_lists[numlist];
-            
-            while ((bp != NULL) && ((asize > GET_SIZE(HDRP(bp)))))                                                   // Don't take blocks that are too small
+    if (use_index) {
+        bp = index_fit(&free_index[numlist], asize, 0);                                                   // Search the index of the first class that may fit ...
+        
+        while ((bp == NULL) && (++numlist < LISTSIZE))                                                    // ... then of the larger ones, where every block fits
+            bp = index_fit(&free_index[numlist], asize, 1);
+    }
+    else {
+        bp = LIST_HEAD(numlist);
+        
+        if (asize > sc_min[numlist]) {                                                                    // Only the first class may hold blocks that are too small
+            ahead = prefetch_dist ? walk_ahead(bp, prefetch_dist) : NULL;
+            while ((bp != NULL) && ((asize > GET_SIZE(HDRP(bp)))))                                        // Don't take blocks that are too small
             {
+                if (--candidates == 0) {                                                                  // The list is sorted, so the first fit is the best one seen : none within the cutoff
+                    bp = NULL;
+                    break;
+                }
                 bp = PRED(bp);
+                ahead = walk_ahead(ahead, 1);
             }
-            if (bp != NULL)
-                break;
         }
         
-        ssize >>= 1;
-        numlist++;
+        while ((bp == NULL) && (++numlist < LISTSIZE))                                                    // Every block of a larger class fits : take the head, the smallest one
+            bp = LIST_HEAD(numlist);
     }
     
     if (bp == NULL) {                                                                                           // if free block is not found, extend the heap
         extendsize = MAX(asize, CHUNKSIZE);
+        extendsize += page_pad(extendsize);
         
-        if ((bp = extend_heap(extendsize)) == NULL)
+        if ((bp = extend_heap(extendsize)) == NULL) {
+            if (shared)
+                unlock_heap();
             return NULL;
+        }
     }
         
     bp = place(bp, asize);                                                                                   //Place the block
     
+    if (shared)
+        unlock_heap();
    return bp;
 }
 
@@ -175,13 +513,30 @@ void *mm_malloc(size_t size)
 
 void mm_free(void *bp)
 {
-    size_t size = GET_SIZE(HDRP(bp));
+    size_t size;
+    
+    if (shared)
+        lock_heap();
+    
+    size = GET_SIZE(HDRP(bp));
     PUT(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
     
     insert(bp, size);
-    coalesce(bp);
     
+    if (RELEASE_MIN) {
+        char *freed = bp;
+        bp = coalesce(bp);
+        if (state->release_blk && --state->release_wait == 0)                 // The waiting block stayed free : its pages are of no use until it is reused
+            release_pending();
+        if (GET_SIZE(HDRP(bp)) >= RELEASE_MIN)
+            defer_release(bp, freed, size);
+    }
+    else
+        coalesce(bp);
+    
+    if (shared)
+        unlock_heap();
     return;
 }
 
@@ -194,11 +549,11 @@ void *mm_realloc(void *ptr, size_t size)
     void *newptr;                                                             // Initialization of the neew block                                                             
     size_t copySize;
    
-    newptr = mm_malloc(size);
+    newptr = mm_malloc(size);                                                 // mm_malloc and mm_free lock a shared heap, the old block stays ours in between
     if (newptr == NULL)
       return NULL;
     
-    copySize = *(size_t *)((char *)oldptr - WSIZE);
+    copySize = GET_SIZE(HDRP(oldptr)) - DSIZE;                                // Payload of the old block : its size less header and footer
     
     if (size < copySize)
       copySize = size;
@@ -209,6 +564,92 @@ void *mm_realloc(void *ptr, size_t size)
 }
    
 
+/* Allocates a block whose payload starts at a multiple of align, a power of two */
+
+void *mm_memalign(size_t align, size_t size)
+{
+    char *bp, *p, *rest;
+    size_t csize, asize;
+    
+    if (align <= ALIGNMENT)                                                   // Every payload is aligned that much already
+        return mm_malloc(size);
+    
+    if ((bp = mm_malloc(size + align + 2*DSIZE)) == NULL)                     // Room to move the payload up to an aligned address with a whole block in front
+        return NULL;
+    
+    if (shared)
+        lock_heap();
+    
+    p = bp;
+    if ((unsigned long)bp & (align - 1)) {                                    // Give the space in front back as a block of its own
+        p = (char *)(((unsigned long)bp + 2*DSIZE + align - 1) & ~(unsigned long)(align - 1));
+        csize = GET_SIZE(HDRP(bp));
+        PUT(HDRP(p), PACK(csize - (p - bp), 1));
+        PUT(FTRP(p), PACK(csize - (p - bp), 1));
+        PUT(HDRP(bp), PACK(p - bp, 1));
+        PUT(FTRP(bp), PACK(p - bp, 1));
+    }
+    
+    asize = MAX(ALIGN(size + DSIZE), 2*DSIZE);
+    csize = GET_SIZE(HDRP(p));
+    rest = NULL;
+    if (csize - asize >= 2*DSIZE) {                                           // Same for the space behind
+        PUT(HDRP(p), PACK(asize, 1));
+        PUT(FTRP(p), PACK(asize, 1));
+        rest = NEXT_BLKP(p);
+        PUT(HDRP(rest), PACK(csize - asize, 1));
+        PUT(FTRP(rest), PACK(csize - asize, 1));
+    }
+    
+    if (shared)
+        unlock_heap();
+    
+    if (p != bp)                                                              // mm_free coalesces them with their free neighbours
+        mm_free(bp);
+    if (rest != NULL)
+        mm_free(rest);
+    return p;
+}
+
+/* Returns the number of bytes the caller may use in an allocated block */
+
+size_t mm_usable_size(void *bp)
+{
+    return GET_SIZE(HDRP(bp)) - DSIZE;
+}
+
+/* Sets the number of candidates the fit search examines in a list, 0 for no cutoff */
+
+void mm_set_fitlimit(int limit)
+{
+    fit_limit = (limit > 0) ? limit : 0;
+}
+
+
+/* Sets how many nodes ahead the free-list walks prefetch, 0 to turn prefetching off */
+
+void mm_set_prefetch(int dist)
+{
+    prefetch_dist = (dist > 0) ? dist : 0;
+}
+
+
+/* Makes mm_malloc, mm_free and mm_realloc safe to call from several threads at once, from the next mm_init on */
+
+void mm_set_threads(int on)
+{
+    threaded = (on != 0);
+}
+
+
+/* Finds the free blocks of a private heap through the index (1) or the segregated lists (0), from the next mm_init on */
+
+void mm_set_index(int on)
+{
+    index_on = (on != 0);
+}
+
+
 /* Extends the heap with free block */
 static void* extend_heap(size_t size){
    
@@ -241,6 +682,20 @@ static void *coalesce(void *bp){
          
    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
    size_t size = GET_SIZE(HDRP(bp)); 
+   size_t released = GET_RELEASED(HDRP(bp));                                              // The merged block has given pages back if any of its parts has
+   
+   if (prefetch_dist && !use_index) {                                                     // removen rewrites the list neighbours of the blocks we merge
+      if (!next_alloc) {
+         walk_ahead(NEXT_BLKP(bp), 1);
+         if (SUCC(NEXT_BLKP(bp)) != NULL)
+            PREFETCH(SUCC(NEXT_BLKP(bp)));
+      }
+      if (!prev_alloc) {
+         walk_ahead(PREV_BLKP(bp), 1);
+         if (SUCC(PREV_BLKP(bp)) != NULL)
+            PREFETCH(SUCC(PREV_BLKP(bp)));
+      }
+   }
    
    // CASE 1 (book)
    if(prev_alloc && next_alloc){
@@ -251,19 +706,21 @@ static void *coalesce(void *bp){
    else if(prev_alloc && !next_alloc){
       removen(bp);                                                                        // Because we inserted bp before calling coalesce function
       size+= GET_SIZE(HDRP(NEXT_BLKP(bp)));                                               // New size of the free block (current + next)
+      released |= GET_RELEASED(HDRP(NEXT_BLKP(bp)));
       removen(NEXT_BLKP(bp));                                                              // Remove the next block of the free list because now it is combined 
-      PUT(HDRP(bp),PACK(size,0));                                                         // Free block header
-      PUT(FTRP(bp),PACK(size,0));                                                         // Free block footer
+      PUT(HDRP(bp),PACK(size,released));                                                  // Free block header
+      PUT(FTRP(bp),PACK(size,released));                                                  // Free block footer
    }
    
    // CASE 3(book)
    else if(!prev_alloc && next_alloc){
         removen(bp);                                                                         // Because we inserted bp before calling coalesce function
         size += GET_SIZE(HDRP(PREV_BLKP(bp)));                                              // New size of the free block (current + previous)
+        released |= GET_RELEASED(HDRP(PREV_BLKP(bp)));
         removen(PREV_BLKP(bp));                                                             // Remove the previous block                                                            
-        PUT(FTRP(bp), PACK(size, 0));                                                       // Free new block header 
+        PUT(FTRP(bp), PACK(size, released));                                                // Free new block header 
         bp = PREV_BLKP(bp);
-        PUT(HDRP(bp), PACK(size, 0));                                                       // Free new block footer 
+        PUT(HDRP(bp), PACK(size, released));                                                // Free new block footer 
         
    }
    
@@ -271,11 +728,12 @@ static void *coalesce(void *bp){
    else{
         removen(bp);                                                                         // Because we inserted bp before calling coalesce function
         size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));              // New size of the free block (current + previous + next)
+        released |= GET_RELEASED(HDRP(PREV_BLKP(bp))) | GET_RELEASED(HDRP(NEXT_BLKP(bp)));
         removen(PREV_BLKP(bp));                                                        // Remove the previous block
         removen(NEXT_BLKP(bp));                                                        // Remove the next block 
         bp = PREV_BLKP(bp);                                                                 // Update the block pointer to the previous block
-        PUT(HDRP(bp), PACK(size, 0));                                                       // Update the new block header
-        PUT(FTRP(bp), PACK(size, 0));                                                       // Update the new block footer
+        PUT(HDRP(bp), PACK(size, released));                                                // Update the new block header
+        PUT(FTRP(bp), PACK(size, released));                                                // Update the new block footer
 }
 
    insert(bp, size);                                                                      // Insert the new block created
@@ -283,25 +741,48 @@ static void *coalesce(void *bp){
 }
 
 
-/* Inserts a block in segregated lists */
+/* Inserts a free block where the fit search will find it : in the index of its class or in its segregated list */
+
 static void insert(void *bp, size_t size){
+    
+    if (use_index)
+        index_insert(bp, size);
+    else
+        list_insert(bp, size);
+}
+
+
+/* Removes a block from the index or the free list */
+
+static void removen(void *bp){
+    
+    if (heap_base + state->release_blk == (char *)bp)                                       // Taken or merged : its pages are wanted, or the merged block waits in its place
+        state->release_blk = 0;
+    if (use_index)
+        index_removen(bp);
+    else
+        list_removen(bp);
+}
+
+
+/* Inserts a block in segregated lists */
+static void list_insert(void *bp, size_t size){
    
-    int numlist = 0;                                                                         //numlist : the specific list where we are going to insert the node
+    int numlist = size_class(size);                                                          //numlist : the specific list where we are going to insert the node
+    int steps = fit_limit;                                                                   // Same cutoff as the fit search : the first fit_limit blocks stay sorted
     void *temp_bp = bp;
     void *insert_bp = NULL;
+    char *ahead;
     
-    // Select segregated list
-     
-    while ((numlist < LISTSIZE - 1) && (size > 1)) {                                       // Find the right list (adapted to block size) : corresponds to number of bits in the size of the block
-        size >>= 1;
-        numlist++;
-    }
-    
-    temp_bp = segregated_lists[numlist];                                                  
+    temp_bp = LIST_HEAD(numlist);                                                  
+    ahead = prefetch_dist ? walk_ahead(temp_bp, prefetch_dist) : NULL;
     
     while (( temp_bp!= NULL) && (size > GET_SIZE(HDRP(temp_bp)))) {                          // Search in list numlist for the right free block(ascending order)
         insert_bp = temp_bp;
         temp_bp = PRED(temp_bp);
+        ahead = walk_ahead(ahead, 1);
+        if (--steps == 0)
+            break;
     }
     
                                                                                              // Set predecessor and successor : update pointers : different cases whether the insertion is at the beginning or the end of the list
@@ -315,7 +796,7 @@ static void insert(void *bp, size_t size){
             SET_PTR(PREV_FREEP(bp), temp_bp);
             SET_PTR(NEXT_FREEP(temp_bp), bp);
             SET_PTR(NEXT_FREEP(bp), NULL);
-            segregated_lists[numlist] = bp;
+            SET_HEAD(numlist, bp);
         }
     } else {
         if (insert_bp != NULL) {
@@ -325,7 +806,7 @@ static void insert(void *bp, size_t size){
         } else {
             SET_PTR(PREV_FREEP(bp), NULL);
             SET_PTR(NEXT_FREEP(bp), NULL);
-            segregated_lists[numlist] = bp;
+            SET_HEAD(numlist, bp);
         }
     }
     
@@ -335,16 +816,9 @@ static void insert(void *bp, size_t size){
 
 /* Removes a block from the free list */
 
-static void removen(void *bp){
-    
-    int numlist = 0;
-    size_t size = GET_SIZE(HDRP(bp));
+static void list_removen(void *bp){
     
- 
-    while ((numlist < LISTSIZE - 1) && (size > 1)) {                   // Select segregated list number where we are going to remove the block 
-        size >>= 1;
-        numlist++;
-    }
+    int numlist = size_class(GET_SIZE(HDRP(bp)));                  // Select segregated list number where we are going to remove the block 
     
     if (PRED(bp) != NULL) {                                        // Different cases wether the block has a preceeding block and a successor in the segregated list chosen
         if (SUCC(bp) != NULL) {
@@ -352,26 +826,140 @@ static void removen(void *bp){
             SET_PTR(PREV_FREEP(SUCC(bp)), PRED(bp));
         } else {
             SET_PTR(NEXT_FREEP(PRED(bp)), NULL);
-            segregated_lists[numlist] = PRED(bp);
+            SET_HEAD(numlist, PRED(bp));
         }
     } else {
         if (SUCC(bp) != NULL) {
             SET_PTR(PREV_FREEP(SUCC(bp)), NULL);
         } else {
-            segregated_lists[numlist] = NULL;
+            SET_HEAD(numlist, NULL);
+        }
+    }
+    
+    return;
+}
+
+
+/* Follows a list nodes steps, prefetching the header of each node reached, and returns the last one (NULL at the end of the list) */
+
+static inline char *walk_ahead(char *bp, int nodes){
+    
+    while ((nodes-- > 0) && (bp != NULL)) {
+        bp = PRED(bp);
+        if (bp != NULL)
+            PREFETCH(HDRP(bp));                                    // The header and the links share a cache line
+    }
+    
+    return bp;
+}
+
+
+/* Inserts a block in the index of its class */
+static void index_insert(void *bp, size_t size){
+    
+    index_list *list = &free_index[size_class(size)];
+    unsigned int *sizes;
+    size_t cap;
+    
+    if (list->count == list->cap) {                                                          // Full : move the entries to arrays twice as large
+        cap = list->cap ? 2*list->cap : INDEX_INIT;
+        if (index_brk + 2*cap*sizeof(unsigned int) > index_size) {                          // No room left : the block stays free but unindexed until it is coalesced
+            SET_SLOT(bp, NO_SLOT);
+            return;
+        }
+        sizes = (unsigned int *)(index_arena + index_brk);
+        index_brk += 2*cap*sizeof(unsigned int);
+        if (list->count) {
+            memcpy(sizes, list->sizes, list->count * sizeof(unsigned int));
+            memcpy(sizes + cap, list->offs, list->count * sizeof(unsigned int));
         }
+        list->sizes = sizes;
+        list->offs = sizes + cap;
+        list->cap = cap;
+    }
+    
+    list->sizes[list->count] = size;
+    list->offs[list->count] = BLK_OFF(bp);
+    SET_SLOT(bp, list->count);
+    list->count++;
+    
+    return;
+}
+
+
+/* Removes a block from the index : the last entry of the class takes its slot */
+
+static void index_removen(void *bp){
+    
+    unsigned int slot = GET_SLOT(bp);
+    index_list *list;
+    
+    if (slot == NO_SLOT)
+        return;
+    
+    list = &free_index[size_class(GET_SIZE(HDRP(bp)))];
+    list->count--;
+    if (slot != list->count) {
+        list->sizes[slot] = list->sizes[list->count];
+        list->offs[slot] = list->offs[list->count];
+        SET_SLOT(OFF_BLK(list->offs[slot]), slot);
     }
     
     return;
 }
 
 
+/* 
+ * Searches the fit_limit most recently freed blocks of a class and returns the smallest one that fits, NULL if none.
+ * In a class above the request every block fits and differs from the others by at most 1 + 2^-SC_SUBBITS, so
+ * with all_fit set we take the most recent one without scanning.
+ */
+
+static void *index_fit(index_list *list, size_t asize, int all_fit){
+    
+    unsigned int end = list->count;
+    unsigned int start = 0;
+    int slot;
+    
+    if (end == 0)
+        return NULL;
+    
+    if (all_fit)
+        return OFF_BLK(list->offs[end - 1]);
+    
+    if ((fit_limit > 0) && (end > (unsigned int)fit_limit))                                // Bounded search : only look at the last fit_limit entries
+        start = end - fit_limit;
+    
+    slot = fit_best(list->sizes + start, end - start, asize);                                // Streams through the sizes, the blocks themselves stay cold
+    
+    return (slot < 0) ? NULL : OFF_BLK(list->offs[start + slot]);
+}
+
+
+/* Returns the size class of a block size, in constant time (tables from sizeclass.h) */
+
+static inline int size_class(size_t size){
+    
+    int k;
+    
+    if (size <= SC_EXACT_MAX)                                      // Small sizes : one exact class per multiple of 8
+        return sc_exact[size >> 3];
+    
+    k = 31 - __builtin_clz((unsigned int)size);                    // Power of two holding size ...
+    if (k >= SC_MAX_SHIFT)
+        return LISTSIZE - 1;
+    
+    return sc_base[k] + ((size >> (k - SC_SUBBITS)) & ((1 << SC_SUBBITS) - 1));   // ... and sub-class inside it
+}
+
+
 /* Places a block of specified size to start of free block */
 
 
 static void *place(void *bp, size_t asize){
    
     size_t csize = GET_SIZE(HDRP(bp));                                               // Get the total size of the free block                                                  
+    size_t released = GET_RELEASED(HDRP(bp));                                        // Pages of the block were given back : the free part keeps the mark, ...
     removen(bp);                                                                       // Remove former free block that we are going to fill
     
 /* CASE 1 : not enough space to have a remaining free space -> no split, only allocation. CASE  2: a lot of free space -> need to split the current space into one allocated space and the remaining free space */
@@ -382,6 +970,8 @@ static void *place(void *bp, size_t asize){
     if((csize - asize) <= 3*DSIZE){                                                                                                                        
         PUT(HDRP(bp), PACK(csize, 1));                                                  // Update header to not free
         PUT(FTRP(bp), PACK(csize, 1));                                                  // Update footer to not free
+        if (released)                                                                   // ... the allocated part gets its pages back in one go rather than a fault at a time
+            mem_populate(bp, csize - DSIZE);
     }
     
 //CASE 2 : need to split 
@@ -390,11 +980,13 @@ static void *place(void *bp, size_t asize){
     
     else if (asize >= 90) {
 
-        PUT(HDRP(bp), PACK(csize-asize, 0));
-        PUT(FTRP(bp), PACK(csize- asize, 0));
+        PUT(HDRP(bp), PACK(csize-asize, released));
+        PUT(FTRP(bp), PACK(csize- asize, released));
         PUT(HDRP(NEXT_BLKP(bp)), PACK(asize, 1));
         PUT(FTRP(NEXT_BLKP(bp)), PACK(asize, 1));
         insert(bp,csize- asize);
+        if (released)                                                                   // From the new footer of the free part to the end of the payload
+            mem_populate(FTRP(bp), asize);
         return NEXT_BLKP(bp);
         
     }
@@ -402,9 +994,11 @@ static void *place(void *bp, size_t asize){
    else {                                                       
         PUT(HDRP(bp), PACK(asize, 1));                                                    // Update header to not free
         PUT(FTRP(bp), PACK(asize, 1));                                                    // Update footer to not free                                                               
-        PUT(HDRP(NEXT_BLKP(bp)), PACK(csize - asize, 0));                                 // Put the header of the new block
-        PUT(FTRP(NEXT_BLKP(bp)), PACK(csize - asize, 0));                                 // Put the footer of the new block
+        PUT(HDRP(NEXT_BLKP(bp)), PACK(csize - asize, released));                          // Put the header of the new block
+        PUT(FTRP(NEXT_BLKP(bp)), PACK(csize - asize, released));                          // Put the footer of the new block
         insert(NEXT_BLKP(bp), csize- asize);                                              // Insert remaining free block
+        if (released)                                                                     // The payload, its footer, and the header and links of the free part
+            mem_populate(bp, asize + DSIZE);
       }
    
     
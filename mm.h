@@ -4,6 +4,14 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern size_t mm_usable_size(void *ptr);
+
+/* Tuning knobs, set by the driver before mm_init */
+extern void mm_set_fitlimit(int limit);
+extern void mm_set_prefetch(int dist);
+extern void mm_set_threads(int on);
+extern void mm_set_index(int on);
 
 
 /* 
@@ -0,0 +1,509 @@
+/*
+ * mmrecord.c - records the malloc, free and realloc calls of a program as
+ *     a trace that mdriver can replay, built as libmmrec.so:
+ *
+ *         unix> MM_RECORD=ls.rep LD_PRELOAD=$PWD/libmmrec.so ls -l
+ *
+ * Each call goes on to glibc (through its __libc_xxx entry points, since
+ * dlsym itself allocates) and is logged in a buffer of the calling thread,
+ * tagged with a global sequence number taken with one atomic add. Full
+ * buffers are appended to MM_RECORD.raw with a single write, so threads
+ * never wait for each other. A free takes its number before the block goes
+ * back to glibc, and an allocation after it comes out, so that a block
+ * freed by one thread and handed to another is logged in that order.
+ *
+ * At exit, the log is sorted by sequence number, addresses are mapped to
+ * dense ids (an id is reused once its block is freed), and the trace is
+ * written to MM_RECORD (mmrecord.<pid>.rep by default), with "t tid"
+ * lines (see trace.c) saying which thread made the ops, numbered by the
+ * buffer it logged them in, for mtreplay. Blocks freed that were not
+ * allocated while recording are left out, and so is whatever threads
+ * still running at exit log after that point. A forked child does not
+ * record.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* glibc's allocator, under the names it exports for wrappers like this */
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+#define RECS_PER_BUF 4096  /* records a thread logs between writes */
+#define MAX_THREADS  1024  /* buffers in use at once; more threads go unlogged */
+
+enum { R_ALLOC, R_FREE, R_REALLOC };
+
+/* One call, as logged */
+typedef struct {
+    unsigned long long seq;   /* position among the calls of all threads */
+    unsigned long long seq2;  /* realloc: position of the new block */
+    void *ptr;                /* block allocated or freed, new block of a realloc */
+    void *old;                /* realloc: the block it replaced */
+    size_t size;
+    int type;                 /* R_xxx */
+    int tid;                  /* buffer of the thread that made the call */
+} rec_t;
+
+typedef struct {
+    int used;                 /* claimed by a live thread */
+    int tid;                  /* its slot in bufs, the thread of its calls in the trace */
+    int count;
+    rec_t recs[RECS_PER_BUF];
+} buf_t;
+
+static int recording = 0;     /* set once the log is open */
+static int raw_fd = -1;
+static char rep_path[4096];
+static char raw_path[4100];
+static unsigned long long next_seq = 0;
+static buf_t *bufs[MAX_THREADS];  /* every buffer ever handed out */
+static pthread_key_t buf_key;
+
+static __thread buf_t *my_buf __attribute__((tls_model("initial-exec")));
+static __thread int in_rec __attribute__((tls_model("initial-exec")));
+
+static void convert(void);
+
+/*
+ * flush - append the records of a buffer to the log
+ */
+static void flush(buf_t *b)
+{
+    size_t len = b->count * sizeof(rec_t);
+    char *p = (char *)b->recs;
+    ssize_t n;
+
+    while (len > 0 && (n = write(raw_fd, p, len)) > 0) {
+	p += n;
+	len -= n;
+    }
+    b->count = 0;
+}
+
+/*
+ * thread_exit - hand the buffer of an exiting thread back, flushed
+ */
+static void thread_exit(void *arg)
+{
+    buf_t *b = arg;
+
+    if (recording)
+	flush(b);
+    __atomic_store_n(&b->used, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * get_buf - returns the buffer of the calling thread, claiming a free one
+ *     or making a new one on its first call. NULL if there is none left.
+ */
+static buf_t *get_buf(void)
+{
+    buf_t *b;
+    int i, zero;
+
+    if (my_buf != NULL)
+	return my_buf;
+    in_rec = 1;
+    for (i = 0; i < MAX_THREADS && my_buf == NULL; i++) {
+	if ((b = __atomic_load_n(&bufs[i], __ATOMIC_ACQUIRE)) == NULL) {
+	    b = mmap(NULL, sizeof(buf_t), PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	    if (b == MAP_FAILED)
+		break;
+	    b->used = 1;
+	    b->tid = i;
+	    if (__atomic_compare_exchange_n(&bufs[i], &(buf_t *){NULL}, b, 0,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		my_buf = b;
+	    else
+		munmap(b, sizeof(buf_t));
+	}
+	else {
+	    zero = 0;
+	    if (__atomic_compare_exchange_n(&b->used, &zero, 1, 0,
+					    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		my_buf = b;
+	}
+    }
+    if (my_buf != NULL)
+	pthread_setspecific(buf_key, my_buf);
+    in_rec = 0;
+    return my_buf;
+}
+
+/*
+ * new_seq - take the next sequence number
+ */
+static inline unsigned long long new_seq(void)
+{
+    return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * log_call - add a record to the buffer of the calling thread
+ */
+static void log_call(int type, unsigned long long seq, unsigned long long seq2,
+		     void *ptr, void *old, size_t size)
+{
+    buf_t *b;
+    rec_t *r;
+
+    if (!recording || in_rec || (b = get_buf()) == NULL)
+	return;
+    r = &b->recs[b->count++];
+    r->seq = seq;
+    r->seq2 = seq2;
+    r->ptr = ptr;
+    r->old = old;
+    r->size = size;
+    r->type = type;
+    r->tid = b->tid;
+    if (b->count == RECS_PER_BUF)
+	flush(b);
+}
+
+static void fork_child(void)
+{
+    recording = 0;
+}
+
+/*
+ * start - open the log before main runs
+ */
+static void __attribute__((constructor)) start(void)
+{
+    char *env = getenv("MM_RECORD");
+
+    if (env != NULL)
+	snprintf(rep_path, sizeof(rep_path), "%s", env);
+    else
+	snprintf(rep_path, sizeof(rep_path), "mmrecord.%d.rep", (int)getpid());
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", rep_path);
+
+    in_rec = 1;
+    raw_fd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (raw_fd < 0) {
+	fprintf(stderr, "mmrecord: cannot open %s\n", raw_path);
+	in_rec = 0;
+	return;
+    }
+    pthread_key_create(&buf_key, thread_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+    in_rec = 0;
+    recording = 1;
+}
+
+/*
+ * stop - flush every buffer and turn the log into a trace at exit
+ */
+static void __attribute__((destructor)) stop(void)
+{
+    int i;
+
+    if (!recording)
+	return;
+    recording = 0;
+    for (i = 0; i < MAX_THREADS && bufs[i] != NULL; i++)
+	flush(bufs[i]);
+    convert();
+    close(raw_fd);
+    unlink(raw_path);
+}
+
+void *malloc(size_t size)
+{
+    void *p = __libc_malloc(size);
+
+    if (p != NULL)
+	log_call(R_ALLOC, new_seq(), 0, p, NULL, size);
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p = __libc_calloc(nmemb, size);
+
+    if (p != NULL)
+	log_call(R_ALLOC, new_seq(), 0, p, NULL, nmemb * size);
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL)
+	return;
+    log_call(R_FREE, new_seq(), 0, ptr, NULL, 0);
+    __libc_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    unsigned long long seq;
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    seq = new_seq();  /* the old block may be reused as soon as we call */
+    if ((p = __libc_realloc(ptr, size)) != NULL)
+	log_call(R_REALLOC, seq, new_seq(), p, ptr, size);
+    return p;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    void *p = __libc_memalign(align, size);
+
+    if (p != NULL)
+	log_call(R_ALLOC, new_seq(), 0, p, NULL, size);
+    return p;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return memalign(align, size);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((p = memalign(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+/*****************************************************
+ * Turning the log into a trace, once recording stops
+ *****************************************************/
+
+/* An event of the log: a record, or one half of a realloc */
+typedef struct {
+    unsigned long long seq;
+    size_t rec;               /* index of the record */
+    int second;               /* 1 for the new block of a realloc */
+} event_t;
+
+/* The live blocks: an open-addressing table from address to id */
+static void **tab_key;
+static unsigned int *tab_id;
+static size_t tab_size, tab_count;
+
+static int by_seq(const void *a, const void *b)
+{
+    const event_t *x = a, *y = b;
+
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static size_t tab_hash(void *p)
+{
+    return ((unsigned long)p >> 4) * 0x9e3779b97f4a7c15UL & (tab_size - 1);
+}
+
+static void tab_grow(void);
+
+/*
+ * trace_size - the size of a request as the trace holds it: mdriver
+ *     reads an int, and a 0-byte request still takes a block in glibc
+ */
+static unsigned int trace_size(size_t size)
+{
+    if (size == 0)
+	return 1;
+    return (size > INT_MAX) ? INT_MAX : (unsigned int)size;
+}
+
+/*
+ * tab_put - record that the block at p has the given id
+ */
+static void tab_put(void *p, unsigned int id)
+{
+    size_t i;
+
+    if (2 * (tab_count + 1) > tab_size)
+	tab_grow();
+    for (i = tab_hash(p); tab_key[i] != NULL; i = (i + 1) & (tab_size - 1))
+	;
+    tab_key[i] = p;
+    tab_id[i] = id;
+    tab_count++;
+}
+
+/*
+ * tab_take - remove the block at p, returning its id, or -1 if unknown
+ */
+static long tab_take(void *p)
+{
+    size_t i, j, k;
+    long id;
+
+    for (i = tab_hash(p); tab_key[i] != p; i = (i + 1) & (tab_size - 1))
+	if (tab_key[i] == NULL)
+	    return -1;
+    id = tab_id[i];
+    tab_count--;
+
+    /* Close the gap, so that probes never stop short of a key */
+    for (j = (i + 1) & (tab_size - 1); tab_key[j] != NULL; j = (j + 1) & (tab_size - 1)) {
+	k = tab_hash(tab_key[j]);
+	if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+	    tab_key[i] = tab_key[j];
+	    tab_id[i] = tab_id[j];
+	    i = j;
+	}
+    }
+    tab_key[i] = NULL;
+    return id;
+}
+
+static void tab_grow(void)
+{
+    void **old_key = tab_key;
+    unsigned int *old_id = tab_id;
+    size_t i, old_size = tab_size;
+
+    tab_size = old_size ? 2 * old_size : 1024;
+    tab_key = __libc_calloc(tab_size, sizeof(void *));
+    tab_id = __libc_malloc(tab_size * sizeof(unsigned int));
+    if (tab_key == NULL || tab_id == NULL) {
+	fprintf(stderr, "mmrecord: out of memory\n");
+	_exit(1);
+    }
+    tab_count = 0;
+    for (i = 0; i < old_size; i++)
+	if (old_key[i] != NULL)
+	    tab_put(old_key[i], old_id[i]);
+    __libc_free(old_key);
+    __libc_free(old_id);
+}
+
+/*
+ * convert - write the trace of the log to rep_path
+ */
+static void convert(void)
+{
+    struct stat st;
+    rec_t *recs, *r;
+    event_t *ev;
+    unsigned int *free_ids, *realloc_ids;
+    size_t nrecs, nev, i, num_free = 0, num_ops = 0;
+    unsigned int num_ids = 0, id;
+    int tid = -1;
+    size_t live = 0, peak = 0, *sizes = NULL, sizes_cap = 0, old_cap;
+    long found;
+    FILE *out, *ops;
+
+    if (fstat(raw_fd, &st) < 0 || st.st_size == 0)
+	return;
+    nrecs = st.st_size / sizeof(rec_t);
+    recs = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, raw_fd, 0);
+    ev = __libc_malloc(2 * nrecs * sizeof(event_t));
+    free_ids = __libc_malloc(nrecs * sizeof(unsigned int));
+    realloc_ids = __libc_malloc(nrecs * sizeof(unsigned int));
+    if (recs == MAP_FAILED || ev == NULL || free_ids == NULL || realloc_ids == NULL ||
+	(ops = tmpfile()) == NULL || (out = fopen(rep_path, "w")) == NULL) {
+	fprintf(stderr, "mmrecord: cannot write %s\n", rep_path);
+	return;
+    }
+
+    for (nev = 0, i = 0; i < nrecs; i++) {
+	ev[nev].seq = recs[i].seq;
+	ev[nev].rec = i;
+	ev[nev++].second = 0;
+	if (recs[i].type == R_REALLOC) {
+	    ev[nev].seq = recs[i].seq2;
+	    ev[nev].rec = i;
+	    ev[nev++].second = 1;
+	}
+    }
+    qsort(ev, nev, sizeof(event_t), by_seq);
+
+    for (i = 0; i < nev; i++) {
+	r = &recs[ev[i].rec];
+	if (r->tid != tid && !(r->type == R_REALLOC && !ev[i].second)) {
+	    tid = r->tid;
+	    fprintf(ops, "t %d\n", tid);
+	}
+	switch (r->type) {
+	case R_ALLOC:
+	    id = num_free ? free_ids[--num_free] : num_ids++;
+	    tab_put(r->ptr, id);
+	    fprintf(ops, "a %u %u\n", id, trace_size(r->size));
+	    break;
+	case R_FREE:
+	    if ((found = tab_take(r->ptr)) < 0)
+		continue;
+	    id = found;
+	    free_ids[num_free++] = id;
+	    fprintf(ops, "f %u\n", id);
+	    break;
+	case R_REALLOC:
+	    if (!ev[i].second) {  /* the old block is gone */
+		found = tab_take(r->old);
+		realloc_ids[ev[i].rec] = (found < 0) ? (unsigned)-1 : (unsigned)found;
+		continue;
+	    }
+	    if ((id = realloc_ids[ev[i].rec]) == (unsigned)-1) {  /* new to us */
+		id = num_free ? free_ids[--num_free] : num_ids++;
+		tab_put(r->ptr, id);
+		fprintf(ops, "a %u %u\n", id, trace_size(r->size));
+		break;
+	    }
+	    tab_put(r->ptr, id);
+	    fprintf(ops, "r %u %u\n", id, trace_size(r->size));
+	    break;
+	default:
+	    continue;
+	}
+	num_ops++;
+
+	/* Track the live bytes for the suggested heap size */
+	if (id >= sizes_cap) {
+	    old_cap = sizes_cap;
+	    sizes_cap = (id < 512) ? 1024 : 2 * id;
+	    if ((sizes = __libc_realloc(sizes, sizes_cap * sizeof(size_t))) == NULL) {
+		fprintf(stderr, "mmrecord: out of memory\n");
+		_exit(1);
+	    }
+	    memset(sizes + old_cap, 0, (sizes_cap - old_cap) * sizeof(size_t));
+	}
+	live -= sizes[id];
+	sizes[id] = (r->type == R_FREE) ? 0 : r->size;
+	live += sizes[id];
+	if (live > peak)
+	    peak = live;
+    }
+
+    /* The header first: heap size, ids, ops, weight */
+    fprintf(out, "%lu\n%u\n%lu\n1\n", (unsigned long)peak, num_ids,
+	    (unsigned long)num_ops);
+    rewind(ops);
+    while ((i = fread(ev, 1, 2 * nrecs * sizeof(event_t), ops)) > 0)
+	fwrite(ev, 1, i, out);
+    fclose(ops);
+    fclose(out);
+
+    munmap(recs, st.st_size);
+    __libc_free(ev);
+    __libc_free(free_ids);
+    __libc_free(realloc_ids);
+    __libc_free(sizes);
+}
@@ -0,0 +1,238 @@
+/*
+ * mmshim.c - malloc, free and the rest of the C allocation interface on
+ *     top of mm.c, built as libmm.so so that real programs run on the
+ *     allocator:
+ *
+ *         unix> LD_PRELOAD=./libmm.so cc -c big.c
+ *
+ * The heap is memlib's: a range reserved once and committed as it grows,
+ * up to MM_MAX_HEAP, or SHIM_MAX_HEAP by default, the most that the 32-bit
+ * offsets of mm.c can reach. One lock serializes every call, and fork
+ * takes it so that the child gets a heap that is not half updated.
+ *
+ * Allocations made while a thread is already inside mm.c or memlib.c
+ * (memlib's own calloc, or libc asking for memory while the shim sets
+ * itself up) come from a small static arena instead, and freeing them
+ * does nothing.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define SHIM_MAX_HEAP    (((size_t)4 << 30) - (1 << 20)) /* heap offsets fit in 32 bits */
+#define SHIM_MAX_REQUEST ((size_t)1 << 30)  /* mem_sbrk takes an int */
+#define BOOT_ARENA       (1 << 20)          /* bytes of the static arena */
+#define BOOT_ALIGN       16
+
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+static int shim_ready = 0;  /* set once mem_init and mm_init have run */
+
+/* Set while the thread holds shim_lock, so that it never waits for itself */
+static __thread int in_mm __attribute__((tls_model("initial-exec")));
+
+static char boot[BOOT_ARENA] __attribute__((aligned(BOOT_ALIGN)));
+static size_t boot_brk = 0;
+
+#define IN_BOOT(p) ((char *)(p) >= boot && (char *)(p) < boot + BOOT_ARENA)
+#define BOOT_SIZE(p) (*(size_t *)((char *)(p) - sizeof(size_t)))
+
+static void fork_prepare(void);
+static void fork_parent(void);
+static void fork_child(void);
+
+/*
+ * boot_alloc - carve size bytes aligned to align out of the static arena,
+ *     keeping the size just in front. Only called with shim_lock held.
+ */
+static void *boot_alloc(size_t align, size_t size)
+{
+    size_t start;
+
+    if (align < BOOT_ALIGN)
+	align = BOOT_ALIGN;
+    start = (boot_brk + sizeof(size_t) + align - 1) & ~(align - 1);
+    if (size > BOOT_ARENA || start + size > BOOT_ARENA) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    boot_brk = start + size;
+    BOOT_SIZE(boot + start) = size;
+    return boot + start;  /* static, so already zero */
+}
+
+/*
+ * enter - take the lock, and set up the heap on first use. Returns 0 if
+ *     the thread is already inside the shim and must use the arena.
+ */
+static int enter(void)
+{
+    if (in_mm)
+	return 0;
+    pthread_mutex_lock(&shim_lock);
+    in_mm = 1;
+    if (!shim_ready) {
+	if (getenv("MM_MAX_HEAP") == NULL)
+	    mem_set_maxheap(SHIM_MAX_HEAP);
+	mem_init();
+	if (mm_init() < 0) {
+	    fprintf(stderr, "libmm: mm_init failed\n");
+	    abort();
+	}
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+	shim_ready = 1;
+    }
+    return 1;
+}
+
+/*
+ * leave - release the lock taken by enter
+ */
+static void leave(void)
+{
+    in_mm = 0;
+    pthread_mutex_unlock(&shim_lock);
+}
+
+/*
+ * shim_alloc - allocate size bytes aligned to align (0 for the default),
+ *     setting errno when there is no memory
+ */
+static void *shim_alloc(size_t align, size_t size)
+{
+    void *p;
+
+    if (!enter())
+	return boot_alloc(align, size);
+    p = NULL;
+    if (size <= SHIM_MAX_REQUEST)
+	p = mm_memalign(align, size ? size : 1);  /* malloc(0) is a block too */
+    leave();
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+void *malloc(size_t size)
+{
+    return shim_alloc(0, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || IN_BOOT(ptr))
+	return;
+    if (!enter())  /* mm.c and memlib.c free nothing of the heap's */
+	return;
+    mm_free(ptr);
+    leave();
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    if ((p = shim_alloc(0, nmemb * size)) != NULL && !IN_BOOT(p))
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    if (IN_BOOT(ptr)) {  /* move it to the heap */
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, (BOOT_SIZE(ptr) < size) ? BOOT_SIZE(ptr) : size);
+	return p;
+    }
+    if (!enter())
+	return NULL;
+    p = (size <= SHIM_MAX_REQUEST) ? mm_realloc(ptr, size) : NULL;
+    leave();
+    if (p == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align % sizeof(void *) != 0 || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((p = shim_alloc(align, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return shim_alloc(align, size);
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align, size);
+}
+
+void *valloc(size_t size)
+{
+    return shim_alloc(getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = getpagesize();
+
+    return shim_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+	return 0;
+    if (IN_BOOT(ptr))
+	return BOOT_SIZE(ptr);
+    return mm_usable_size(ptr);
+}
+
+/*
+ * fork_xxx - hold the lock across fork, so that no other thread is in
+ *     the middle of a call when the child's copy of the heap is taken
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&shim_lock);
+}
+
+static void fork_parent(void)
+{
+    pthread_mutex_unlock(&shim_lock);
+}
+
+static void fork_child(void)
+{
+    pthread_mutex_unlock(&shim_lock);
+}
@@ -0,0 +1,212 @@
+/*
+ * mpstress.c - multi-process stress test and benchmark of mm.c on a heap
+ *     in POSIX shared memory.
+ *
+ * The parent lays out the heap, then forks workers. Each maps the heap
+ * again, at another address than the parent's, and runs random mallocs
+ * and frees against it. Every block is stamped with its owner and slot,
+ * and the stamp is checked before the block is freed, so that a block
+ * handed to two processes at once shows up as an error. Reports the
+ * throughput for 1, 2, 4, ... up to -p processes.
+ *
+ * With -k, the first worker of each run with more than one process is
+ * killed halfway: the robust lock hands the heap over to the others.
+ *
+ * usage: mpstress [-p <procs>] [-n <ops>] [-s <maxsize>] [-m <heap>] [-k]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define MAXPROCS 64    /* most worker processes */
+#define SLOTS    1024  /* live blocks per worker, at most */
+#define STAMP    64    /* bytes stamped at each end of a block */
+
+/*
+ * stamp - write (or with check set, verify) the stamp of a block at both
+ *     ends. Returns the number of bytes that differ.
+ */
+static int stamp(char *p, int size, int id, int slot, int check)
+{
+    int i, j, pos, n = (size < STAMP) ? size : STAMP, bad = 0;
+    char c;
+
+    for (i = 0; i < n; i++) {
+	for (j = 0; j < 2; j++) {
+	    pos = j ? size - 1 - i : i;
+	    c = (char)(id * 131 + slot * 7 + pos);
+	    if (!check)
+		p[pos] = c;
+	    else if (p[pos] != c)
+		bad++;
+	}
+    }
+    return bad;
+}
+
+/*
+ * worker - map the heap again and run nops random requests on it.
+ *     Returns the number of blocks found damaged.
+ */
+static int worker(int id, int nops, int maxsize)
+{
+    char *blocks[SLOTS];
+    int sizes[SLOTS];
+    int i, k, errors = 0;
+    unsigned int x = 2463534242u + id;
+
+    /*
+     * Map the heap somewhere else than the parent, by leaving a little
+     * of the parent's range mapped to something else
+     */
+    mem_deinit();
+    if (mmap(NULL, (id + 1) * getpagesize(), PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == MAP_FAILED)
+	exit(2);
+    mem_init();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mpstress: worker %d: mm_init failed\n", id);
+	exit(2);
+    }
+
+    memset(blocks, 0, sizeof(blocks));
+    for (i = 0; i < nops; i++) {
+	x ^= x << 13; x ^= x >> 17; x ^= x << 5;  /* xorshift32 */
+	k = x % SLOTS;
+	if (blocks[k] != NULL) {
+	    errors += (stamp(blocks[k], sizes[k], id, k, 1) != 0);
+	    mm_free(blocks[k]);
+	    blocks[k] = NULL;
+	}
+	else {
+	    sizes[k] = 1 + (x >> 10) % maxsize;
+	    if ((blocks[k] = mm_malloc(sizes[k])) == NULL) {
+		fprintf(stderr, "mpstress: worker %d: mm_malloc failed\n", id);
+		exit(2);
+	    }
+	    stamp(blocks[k], sizes[k], id, k, 0);
+	}
+    }
+    for (k = 0; k < SLOTS; k++) {
+	if (blocks[k] != NULL) {
+	    errors += (stamp(blocks[k], sizes[k], id, k, 1) != 0);
+	    mm_free(blocks[k]);
+	}
+    }
+    return errors;
+}
+
+/*
+ * run - lay out a fresh heap and run procs workers on it at once.
+ *     Returns the wall time, and the ops and errors of the workers that
+ *     finished.
+ */
+static double run(int procs, int nops, int maxsize, int kill_one,
+		  double *ops, int *errors)
+{
+    pid_t pids[MAXPROCS];
+    struct timespec start, end;
+    int i, status;
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mpstress: mm_init failed\n");
+	exit(1);
+    }
+
+    fflush(stdout);  /* or each worker would print it again */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < procs; i++) {
+	if ((pids[i] = fork()) < 0) {
+	    perror("mpstress: fork");
+	    exit(1);
+	}
+	if (pids[i] == 0)
+	    _exit(worker(i, nops, maxsize) ? 1 : 0);
+    }
+    if (kill_one && procs > 1) {
+	usleep(2000);
+	kill(pids[0], SIGKILL);
+    }
+
+    *ops = 0;
+    *errors = 0;
+    for (i = 0; i < procs; i++) {
+	waitpid(pids[i], &status, 0);
+	if (WIFEXITED(status)) {
+	    *ops += nops;
+	    if (WEXITSTATUS(status) != 0)
+		(*errors)++;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    int c, procs, errors;
+    int maxprocs = 4, nops = 1000000, maxsize = 4096, kill_one = 0;
+    size_t heap = 0;
+    double secs, ops;
+    char name[64];
+
+    while ((c = getopt(argc, argv, "p:n:s:m:kh")) != EOF) {
+	switch (c) {
+	case 'p':
+	    maxprocs = atoi(optarg);
+	    break;
+	case 'n':
+	    nops = atoi(optarg);
+	    break;
+	case 's':
+	    maxsize = atoi(optarg);
+	    break;
+	case 'm':
+	    heap = mem_parse_size(optarg);
+	    break;
+	case 'k':
+	    kill_one = 1;
+	    break;
+	default:
+	    fprintf(stderr, "usage: mpstress [-p <procs>] [-n <ops>] "
+		    "[-s <maxsize>] [-m <heap>] [-k]\n");
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (maxprocs < 1 || maxprocs > MAXPROCS || nops < 1 || maxsize < 1) {
+	fprintf(stderr, "mpstress: need 1 to %d procs, and positive ops "
+		"and size\n", MAXPROCS);
+	exit(1);
+    }
+
+    /* Room for every worker's blocks at once, twice over */
+    if (heap == 0)
+	heap = 2 * (size_t)maxprocs * SLOTS * (maxsize + 16) + (1 << 20);
+    mem_set_maxheap(heap);
+    sprintf(name, "/mpstress.%d", (int)getpid());
+    mem_set_shared(name);
+    mem_init();
+
+    /* errors counts the workers that found a damaged block */
+    printf("%5s%10s%10s%8s%8s\n", "procs", "ops", "secs", "Kops", "errors");
+    for (procs = 1; ; procs = (2 * procs < maxprocs) ? 2 * procs : maxprocs) {
+	secs = run(procs, nops, maxsize, kill_one, &ops, &errors);
+	printf("%5d%10.0f%10.3f%8.0f%8d\n", procs, ops, secs,
+	       ops / 1e3 / secs, errors);
+	if (procs == maxprocs)
+	    break;
+    }
+
+    mem_deinit();
+    shm_unlink(name);
+    return 0;
+}
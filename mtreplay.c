@@ -0,0 +1,398 @@
+/*
+ * mtreplay.c - replays a trace on real threads, against mm.c made safe
+ *     for threads by mm_set_threads (one lock around the heap), and with
+ *     -l against libc malloc too. Reports the throughput, and the latency
+ *     of the requests, for 1, 2, 4, ... up to -p threads.
+ *
+ * A trace with threads (the "t tid" lines of trace.c, which tracegen -T
+ * and mmrecord write) is split into one stream of ops per thread, and
+ * with fewer workers than threads, worker tid % workers runs thread
+ * tid's. The ordering points are the ops on a block whose op before it
+ * is another worker's, as when a block is freed by another thread than
+ * the one that allocated it: such an op waits until that one is done.
+ * Each worker keeps to the order of the trace and only ever waits on an
+ * op before the one it is at, so the replay cannot deadlock. A trace
+ * without threads is replayed whole by every worker, on ids of its own,
+ * so that the work grows with the workers.
+ *
+ * Each block of 8 bytes or more is stamped with its id in its first and
+ * last 4 bytes, and the stamp is checked when the block is freed or
+ * reallocated, possibly by another worker, so that a block handed out
+ * twice, or corrupted by a race in the allocator, shows up as an error.
+ * One op in LAT_SAMPLE is timed on its own for the latencies: the mean,
+ * median, 99th percentile and worst, in ns. The waits at ordering points
+ * are in the throughput, not in the latencies.
+ *
+ * usage: mtreplay [-p <threads>] [-m <heap>] [-l] <trace>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "trace.h"
+
+#define MAXTHREADS 64    /* most worker threads */
+#define LAT_SAMPLE 16    /* one op in this many is timed on its own */
+#define SPINS      100   /* looks at an ordering point before yielding the CPU */
+
+/* An allocator to replay the trace on */
+typedef struct {
+    char *name;
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+} allocator_t;
+
+/* A worker thread, and what it measured */
+typedef struct {
+    int *mine;           /* the ops it runs, in trace order... */
+    int n;               /* ... how many... */
+    int base;            /* ... and what it adds to their ids */
+    long *lat;           /* the latencies it sampled, in ns... */
+    int nlat;            /* ... and how many */
+    int errors;          /* blocks it found damaged */
+    pthread_t thread;
+} worker_t;
+
+/* What a run of the workers measured */
+typedef struct {
+    double secs;
+    double ops;
+    double mean;         /* latencies, in ns */
+    long p50, p99, max;
+    int errors;
+} result_t;
+
+static trace_t *trace;
+static allocator_t *alloc;       /* the allocator of this run */
+static traceblock_t *blocks;     /* the block of each id, of every copy */
+static int *order;               /* every op, in trace order */
+static int *wait_for;            /* op each op waits for, or -1 */
+static unsigned char *done;      /* ops done, of a trace with threads */
+static pthread_barrier_t start_line;
+
+/*
+ * mm_start, libc_start - set up a fresh heap for a run
+ */
+static int mm_start(void)
+{
+    mem_reset_brk();
+    return mm_init();
+}
+
+static int libc_start(void)
+{
+    return 0;
+}
+
+static allocator_t allocators[] = {
+    {"mm.c", mm_start, mm_malloc, mm_free, mm_realloc},
+    {"libc", libc_start, malloc, free, realloc},
+};
+
+/*
+ * stamp - write (or with check set, verify) the id of a block into its
+ *     first and last 4 bytes. Returns 1 if the block is damaged.
+ */
+static int stamp(traceblock_t *b, unsigned int id, int check)
+{
+    unsigned int v[2];
+
+    if (b->p == NULL || b->size < 8)  /* ends that overlap would not hold */
+	return 0;
+    if (!check) {
+	memcpy(b->p, &id, 4);
+	memcpy(b->p + b->size - 4, &id, 4);
+	return 0;
+    }
+    memcpy(&v[0], b->p, 4);
+    memcpy(&v[1], b->p + b->size - 4, 4);
+    return v[0] != id || v[1] != id;
+}
+
+/*
+ * worker - run the ops of one worker, once every worker is ready
+ */
+static void *worker(void *arg)
+{
+    worker_t *w = arg;
+    const traceop_t *op;
+    traceblock_t *b;
+    struct timespec t0, t1;
+    int i, j, k, spins, sample;
+    unsigned int id;
+    char *p;
+
+    pthread_barrier_wait(&start_line);
+    for (k = 0; k < w->n; k++) {
+	i = w->mine[k];
+	op = &trace->ops[i];
+	if (done != NULL && (j = wait_for[i]) >= 0)  /* an ordering point */
+	    for (spins = 0; !__atomic_load_n(&done[j], __ATOMIC_ACQUIRE); spins++)
+		if (spins >= SPINS)
+		    sched_yield();
+
+	id = op->index + w->base;
+	b = &blocks[id];
+	if (op->type != ALLOC)
+	    w->errors += stamp(b, id, 1);
+
+	sample = (k % LAT_SAMPLE == 0);
+	if (sample)
+	    clock_gettime(CLOCK_MONOTONIC, &t0);
+	switch (op->type) {
+	case ALLOC:
+	    p = alloc->malloc(op->size);
+	    break;
+	case REALLOC:
+	    p = (b->p != NULL) ? alloc->realloc(b->p, op->size) : alloc->malloc(op->size);
+	    break;
+	default:
+	    if (b->p != NULL)
+		alloc->free(b->p);
+	    p = NULL;
+	}
+	if (sample) {
+	    clock_gettime(CLOCK_MONOTONIC, &t1);
+	    w->lat[w->nlat++] = (t1.tv_sec - t0.tv_sec) * 1000000000L +
+		(t1.tv_nsec - t0.tv_nsec);
+	}
+	if (p == NULL && op->type != FREE && op->size > 0) {
+	    fprintf(stderr, "mtreplay: %s ran out of memory (try a larger -m)\n",
+		    alloc->name);
+	    exit(1);
+	}
+
+	b->p = p;
+	b->size = (op->type == FREE) ? 0 : op->size;
+	stamp(b, id, 0);
+	if (done != NULL)
+	    __atomic_store_n(&done[i], 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * by_value - order latencies for qsort
+ */
+static int by_value(const void *a, const void *b)
+{
+    long x = *(const long *)a, y = *(const long *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * run - replay the trace on workers threads at once, and measure it
+ */
+static void run(int workers, result_t *res)
+{
+    worker_t w[MAXTHREADS];
+    struct timespec start, end;
+    int i, k, copies, num_ops = trace->num_ops, *last, *mine, *count;
+    long *lat, sum = 0;
+    size_t nblocks;
+
+    copies = (trace->tids != NULL) ? 1 : workers;
+    nblocks = (size_t)trace->num_ids * copies;
+    memset(blocks, 0, nblocks * sizeof(traceblock_t));
+    memset(w, 0, sizeof(w));
+
+    if (trace->tids != NULL) {
+	/* Deal the ops to the workers, and find the ordering points */
+	mine = (int *)malloc(num_ops * sizeof(int) + 1);
+	last = (int *)malloc(trace->num_ids * sizeof(int) + 1);
+	count = (int *)calloc(workers + 1, sizeof(int));
+	if (mine == NULL || last == NULL || count == NULL) {
+	    fprintf(stderr, "mtreplay: out of memory\n");
+	    exit(1);
+	}
+	for (i = 0; i < num_ops; i++)
+	    count[trace->tids[i] % workers + 1]++;
+	for (k = 0; k < workers; k++) {
+	    count[k + 1] += count[k];
+	    w[k].mine = mine + count[k];
+	}
+	for (i = 0; i < trace->num_ids; i++)
+	    last[i] = -1;
+	for (i = 0; i < num_ops; i++) {
+	    k = trace->tids[i] % workers;
+	    w[k].mine[w[k].n++] = i;
+	    wait_for[i] = last[trace->ops[i].index];
+	    if (wait_for[i] >= 0 && trace->tids[wait_for[i]] % workers == k)
+		wait_for[i] = -1;  /* the worker's own op, done already */
+	    last[trace->ops[i].index] = i;
+	}
+	memset(done, 0, num_ops);
+	free(last);
+	free(count);
+    }
+    else {
+	mine = NULL;
+	for (k = 0; k < workers; k++) {
+	    w[k].mine = order;
+	    w[k].n = num_ops;
+	    w[k].base = k * trace->num_ids;
+	}
+    }
+
+    for (k = 0; k < workers; k++)
+	if ((w[k].lat = (long *)malloc((w[k].n / LAT_SAMPLE + 1) * sizeof(long))) == NULL) {
+	    fprintf(stderr, "mtreplay: out of memory\n");
+	    exit(1);
+	}
+
+    if (alloc->init() < 0) {
+	fprintf(stderr, "mtreplay: %s: init failed\n", alloc->name);
+	exit(1);
+    }
+    pthread_barrier_init(&start_line, NULL, workers + 1);
+    for (k = 0; k < workers; k++)
+	if (pthread_create(&w[k].thread, NULL, worker, &w[k]) != 0) {
+	    fprintf(stderr, "mtreplay: cannot start %d threads\n", workers);
+	    exit(1);
+	}
+    pthread_barrier_wait(&start_line);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (k = 0; k < workers; k++)
+	pthread_join(w[k].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    pthread_barrier_destroy(&start_line);
+
+    /* Blocks the trace leaves allocated, untimed */
+    for (i = 0; i < (int)nblocks; i++)
+	if (blocks[i].p != NULL)
+	    alloc->free(blocks[i].p);
+
+    memset(res, 0, sizeof(*res));
+    res->secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    res->ops = (double)num_ops * copies;
+    for (k = 0; k < workers; k++)
+	res->errors += w[k].errors;
+
+    /* Pool the latencies of the workers */
+    for (i = 0, k = 0; k < workers; k++)
+	i += w[k].nlat;
+    if ((lat = (long *)malloc(i * sizeof(long) + 1)) == NULL) {
+	fprintf(stderr, "mtreplay: out of memory\n");
+	exit(1);
+    }
+    for (i = 0, k = 0; k < workers; k++) {
+	memcpy(lat + i, w[k].lat, w[k].nlat * sizeof(long));
+	i += w[k].nlat;
+	free(w[k].lat);
+    }
+    if (i > 0) {
+	qsort(lat, i, sizeof(long), by_value);
+	for (k = 0; k < i; k++)
+	    sum += lat[k];
+	res->mean = (double)sum / i;
+	res->p50 = lat[i / 2];
+	res->p99 = lat[(int)(i * 0.99)];
+	res->max = lat[i - 1];
+    }
+    free(lat);
+    free(mine);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mtreplay [-p <threads>] [-m <heap>] [-l] <trace>\n");
+    fprintf(stderr, "\t-p <threads>  Most threads to run on (default: the threads of\n");
+    fprintf(stderr, "\t              the trace, or 4 for a trace without them).\n");
+    fprintf(stderr, "\t-m <heap>     Size of the mm.c heap (default: room for each\n");
+    fprintf(stderr, "\t              worker's copy of the trace, twice over).\n");
+    fprintf(stderr, "\t-l            Also replay on libc malloc.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, a, threads, nallocs = 1, maxthreads = 0;
+    size_t heap = 0, copies;
+    result_t res;
+
+    while ((c = getopt(argc, argv, "p:m:lh")) != EOF) {
+	switch (c) {
+	case 'p':
+	    maxthreads = atoi(optarg);
+	    break;
+	case 'm':
+	    heap = mem_parse_size(optarg);
+	    break;
+	case 'l':
+	    nallocs = 2;
+	    break;
+	default:
+	    usage();
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (argc - optind != 1 || maxthreads < 0 || maxthreads > MAXTHREADS) {
+	usage();
+	fprintf(stderr, "mtreplay: need one trace, and at most %d threads\n",
+		MAXTHREADS);
+	exit(1);
+    }
+
+    trace = trace_read(argv[optind]);
+    if (maxthreads == 0)
+	maxthreads = (trace->tids != NULL) ? trace->num_threads : 4;
+    if (trace->tids != NULL && maxthreads > trace->num_threads)
+	maxthreads = trace->num_threads;  /* more would have nothing to do */
+    if (maxthreads > MAXTHREADS)
+	maxthreads = MAXTHREADS;
+
+    copies = (trace->tids != NULL) ? 1 : maxthreads;
+    if ((blocks = (traceblock_t *)malloc(trace->num_ids * copies *
+					 sizeof(traceblock_t) + 1)) == NULL ||
+	(order = (int *)malloc(trace->num_ops * sizeof(int) + 1)) == NULL ||
+	(wait_for = (int *)malloc(trace->num_ops * sizeof(int) + 1)) == NULL ||
+	(trace->tids != NULL && (done = (unsigned char *)malloc(trace->num_ops + 1)) == NULL)) {
+	fprintf(stderr, "mtreplay: out of memory\n");
+	exit(1);
+    }
+    for (i = 0; i < trace->num_ops; i++)
+	order[i] = i;
+
+    /* Room for every worker's copy of the trace at once, twice over */
+    if (heap == 0)
+	heap = 2 * copies * (size_t)trace->sugg_heapsize + (64 << 20);
+    mem_set_maxheap(heap);
+    mem_init();
+    mm_set_threads(1);
+
+    printf("%s: %d ops, %d ids, ", argv[optind], trace->num_ops, trace->num_ids);
+    if (trace->tids != NULL)
+	printf("%d threads\n", trace->num_threads);
+    else
+	printf("no threads (each worker replays it)\n");
+
+    /* errors counts the blocks found damaged */
+    for (a = 0; a < nallocs; a++) {
+	alloc = &allocators[a];
+	printf("%-5s%8s%12s%10s%9s%8s%8s%10s%10s\n", alloc->name, "threads",
+	       "ops", "secs", "Kops", "mean", "p50", "p99", "max");
+	for (threads = 1; ; threads = (2 * threads < maxthreads) ? 2 * threads : maxthreads) {
+	    run(threads, &res);
+	    printf("%5s%8d%12.0f%10.3f%9.0f%8.0f%8ld%10ld%10ld", "", threads,
+		   res.ops, res.secs, res.ops / 1e3 / res.secs, res.mean,
+		   res.p50, res.p99, res.max);
+	    if (res.errors > 0)
+		printf("  %d errors", res.errors);
+	    printf("\n");
+	    if (threads == maxthreads)
+		break;
+	}
+    }
+
+    mem_deinit();
+    trace_free(trace);
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * perfctr.c - read hardware performance counters around a piece of
+ *     code with the Linux perf_event_open system call. Each counter is
+ *     opened on its own, so a CPU or kernel that lacks one (backend 
+ *     stalls are often missing) still gives us the others. Counting 
+ *     is restricted to user mode so that unprivileged users can run it.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+#ifdef __linux__
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int fds[PERFCTR_N] = {-1, -1, -1, -1};
+
+static unsigned long long configs[PERFCTR_N] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+};
+
+/*
+ * perfctr_open - open every counter the system lets us have
+ */
+int perfctr_open(void)
+{
+    int i, n = 0;
+    struct perf_event_attr attr;
+
+    for (i = 0; i < PERFCTR_N; i++) {
+	if (fds[i] >= 0) {
+	    n++;
+	    continue;
+	}
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = configs[i];
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    return n;
+}
+
+/*
+ * perfctr_start - zero the open counters and let them run
+ */
+void perfctr_start(void)
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_N; i++) {
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+/*
+ * perfctr_stop - stop the counters and read their values
+ */
+void perfctr_stop(long long counts[PERFCTR_N])
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_N; i++) {
+	counts[i] = -1;
+	if (fds[i] < 0)
+	    continue;
+	ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+	if (read(fds[i], &counts[i], sizeof(long long)) != sizeof(long long))
+	    counts[i] = -1;
+    }
+}
+
+#else /* !__linux__ */
+
+int perfctr_open(void)
+{
+    return 0;
+}
+
+void perfctr_start(void)
+{
+}
+
+void perfctr_stop(long long counts[PERFCTR_N])
+{
+    int i;
+
+    for (i = 0; i < PERFCTR_N; i++)
+	counts[i] = -1;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,22 @@
+/* 
+ * Hardware performance counters (Linux perf_event_open) 
+ */
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+#define PERFCTR_CYCLES     0  /* core cycles */
+#define PERFCTR_INSNS      1  /* instructions retired */
+#define PERFCTR_LLC_MISSES 2  /* last-level cache misses */
+#define PERFCTR_STALLS     3  /* cycles stalled in the backend */
+#define PERFCTR_N          4
+
+/* Open the counters for this process. Returns how many are available */
+int perfctr_open(void);
+
+/* Reset and start the counters */
+void perfctr_start(void);
+
+/* Stop the counters and read them; unavailable ones read as -1 */
+void perfctr_stop(long long counts[PERFCTR_N]);
+
+#endif /* __PERFCTR_H_ */
@@ -0,0 +1,973 @@
+/*
+ * trace.c - reading and writing allocator traces
+ *
+ * A text trace (.rep) is a header of four numbers, the suggested heap
+ * size, the number of ids, the number of ops and a weight, followed by
+ * one op per line: "a id size", "r id size" or "f id". Reading one means
+ * parsing every token.
+ *
+ * A text trace of a threaded program also has lines "t tid", each of
+ * which says that the ops after it, up to the next, are made by thread
+ * tid. The order of the lines is still an order the ops can run in one
+ * thread, so the driver replays such a trace as any other; trace_read
+ * keeps the threads in tids, for mtreplay. The other formats, and
+ * streamed traces, have no room for them, so writing such a trace in
+ * another format, or from a stream, fails rather than lose them.
+ *
+ * A binary trace starts with a trace_hdr_t, and holds the ops as an
+ * array of traceop_t, so reading it is a mmap: the ops are used where
+ * they lie in the page cache, and only the pages the driver touches are
+ * ever read from disk. traceconv writes binary traces from text ones.
+ *
+ * A compressed trace has the same header, and codes each op in as few
+ * bytes as it can: a tag byte with the type and the change of id from
+ * the op before, then the size as a varint, or a tag that repeats the
+ * op before with the same change of id and the same size, some number
+ * of times. The coding starts afresh at every entry of the index, which
+ * is where a reader can start.
+ *
+ * A trace of any format can also be streamed, for traces larger than
+ * memory: trace_open reads only the header, and a thread reads and
+ * decodes ahead into a ring of TRACE_SLOTS chunks of TRACE_CHUNK ops,
+ * while the driver replays the chunks before them. At the end of the
+ * trace the thread starts over from where the pass started, so that the
+ * next pass finds its first chunks ready. A pass that fits in the ring,
+ * a short trace or a -w window, is read into the ring once more and
+ * kept there, when the next pass starts or when trace_keep asks: later
+ * passes neither read nor decode it again. The ids' blocks grow as the
+ * ops name new ids.
+ */
+#define _FILE_OFFSET_BITS 64  /* streamed traces may be larger than 2 GB */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024  /* max string size */
+#define TRACE_SLOTS 4 /* chunks in the ring of a stream */
+
+/* The formats of a trace file */
+enum {TEXT, BINARY, COMPRESSED};
+
+#define RUN     3     /* tag type of a run of repeats of the op before */
+#define TAG_MAX 63    /* tag values from here on continue in a varint */
+
+/* The reader of a streamed trace */
+struct trace_stream {
+    char *path;
+    FILE *f;
+    int format;                  /* TEXT, BINARY or COMPRESSED */
+    int num_ops;
+    off_t ops_off;               /* file offset of the first op */
+    trace_index_t *index;        /* index of a compressed trace... */
+    int stride;                  /* ... and the ops between its entries */
+    int pos;                     /* op number at the file position */
+    int skip;                    /* ops to read past before the next chunk */
+    int tid;                     /* thread of the text ops being parsed... */
+    int max_tid;                 /* ... the largest one so far, -1 if none... */
+    unsigned short *tids;        /* ... and where to keep them, or NULL */
+    int start;                   /* op number the last seek went to... */
+    int handed;                  /* ... the chunks handed out since... */
+    int pinned;                  /* ... and how many of them the ring keeps */
+    int run;                     /* compressed ops left of the op or run... */
+    traceop_t last;              /* ... that repeat this op */
+    int delta;                   /* ... with this change of id */
+    traceop_t *buf[TRACE_SLOTS]; /* the ring of chunks... */
+    int at[TRACE_SLOTS];         /* ... the op number each starts at... */
+    int len[TRACE_SLOTS];        /* ... and the ops in each, -1 if empty */
+    int fill;                    /* chunk the thread fills next */
+    int use;                     /* chunk handed out next */
+    int held;                    /* chunk handed out last, or -1 */
+    int stop;                    /* tells the thread to finish */
+    int running;                 /* is there a thread to join? */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int read_header(trace_stream_t *s, trace_t *trace);
+static int read_ops(trace_stream_t *s, traceop_t *ops, int n);
+static int parse_ops(trace_stream_t *s, traceop_t *ops, int n);
+static int decode_ops(trace_stream_t *s, traceop_t *ops, int n);
+static unsigned long long get_varint(FILE *f);
+static void put_varint(FILE *f, unsigned long long v);
+static void put_tag(FILE *f, int type, unsigned long long v);
+static void *read_ahead(void *arg);
+static int read_chunk(trace_stream_t *s, traceop_t *ops);
+static void stream_position(trace_stream_t *s, int first);
+static void stream_stop(trace_stream_t *s);
+static void stream_seek(trace_stream_t *s, int first);
+static void stream_pin(trace_stream_t *s);
+static void alloc_ring(trace_stream_t *s);
+static void stream_close(trace_stream_t *s);
+static void alloc_blocks(trace_t *trace);
+static void check_tags(trace_t *trace, const char *path, int text);
+static void trace_error(const char *msg, const char *path);
+
+/*
+ * trace_read - read a trace file of any format and store it in memory
+ */
+trace_t *trace_read(const char *path)
+{
+    trace_t *trace = trace_open(path);
+    trace_stream_t *s = trace->stream;
+    struct stat st;
+    char *map;
+    int i, max_index = 0;
+
+    if (s->format == BINARY) {
+	/* Map the file, and use the ops where they lie */
+	if (fstat(fileno(s->f), &st) < 0 || (unsigned long long)st.st_size < 
+	    s->ops_off + (unsigned long long)trace->num_ops * sizeof(traceop_t))
+	    trace_error("Truncated binary trace", path);
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(s->f), 0);
+	if (map == MAP_FAILED)
+	    trace_error("Could not map trace", path);
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	trace->ops = (traceop_t *)(map + s->ops_off);
+	trace->map = map;
+	trace->map_len = st.st_size;
+    }
+    else {
+	/* We'll store each request line in the trace in this array */
+	if ((trace->ops =
+	     (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL ||
+	    (s->format == TEXT && (s->tids = (unsigned short *)
+		malloc(trace->num_ops * sizeof(unsigned short) + 1)) == NULL))
+	    trace_error("malloc failed in trace_read", path);
+	if (read_ops(s, trace->ops, trace->num_ops) != trace->num_ops)
+	    trace_error("Fewer ops than the header says in", path);
+	if (s->max_tid >= 0) {
+	    trace->tids = s->tids;
+	    trace->num_threads = s->max_tid + 1;
+	}
+	else
+	    free(s->tids);
+	s->tids = NULL;
+	for (i = 0; i < trace->num_ops; i++)
+	    if (trace->ops[i].type != FREE && trace->ops[i].index > max_index)
+		max_index = trace->ops[i].index;
+	assert(trace->num_ops == 0 || max_index == trace->num_ids - 1);
+    }
+    stream_close(s);
+    trace->stream = NULL;
+    return trace;
+}
+
+/*
+ * trace_open - open a trace file of any format to be streamed. Only the
+ *    header is read here; trace_ops reads the ops as they are needed.
+ */
+trace_t *trace_open(const char *path)
+{
+    trace_t *trace;
+    trace_stream_t *s;
+    int i;
+
+    if ((trace = (trace_t *)calloc(1, sizeof(trace_t))) == NULL ||
+	(s = (trace_stream_t *)calloc(1, sizeof(trace_stream_t))) == NULL ||
+	(s->path = strdup(path)) == NULL)
+	trace_error("malloc failed in trace_open", path);
+    if ((s->f = fopen(path, "rb")) == NULL)
+	trace_error("Could not open trace", path);
+    s->format = read_header(s, trace);
+    s->num_ops = trace->num_ops;
+    s->held = -1;
+    s->max_tid = -1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    for (i = 0; i < TRACE_SLOTS; i++)
+	s->len[i] = -1;
+
+    trace->stream = s;
+    alloc_blocks(trace);
+    return trace;
+}
+
+/*
+ * read_header - read the header of the trace file of s into trace, and
+ *    the index if it is compressed. Returns the format of the file.
+ */
+static int read_header(trace_stream_t *s, trace_t *trace)
+{
+    trace_hdr_t hdr;
+    int format;
+
+    errno = 0;
+    if (fread(&hdr, sizeof(hdr), 1, s->f) == 1 && 
+	(hdr.magic == TRACE_MAGIC || hdr.magic == TRACE_ZMAGIC)) {
+	format = (hdr.magic == TRACE_MAGIC) ? BINARY : COMPRESSED;
+	if (hdr.version != TRACE_VERSION || 
+	    hdr.op_size != ((format == BINARY) ? sizeof(traceop_t) : 0) ||
+	    (format == COMPRESSED && hdr.index_stride == 0))
+	    trace_error("Unsupported version of the binary trace format (convert it again) in",
+			s->path);
+	if (hdr.num_ops < 0 || hdr.num_ids < 0)
+	    trace_error("Bad trace header in", s->path);
+	trace->sugg_heapsize = hdr.sugg_heapsize;
+	trace->num_ids = hdr.num_ids;
+	trace->num_ops = hdr.num_ops;
+	trace->weight = hdr.weight;
+	s->ops_off = hdr.ops_off;
+	if (format == COMPRESSED) {
+	    s->stride = hdr.index_stride;
+	    if (hdr.index_len != (hdr.num_ops + s->stride - 1ULL) / s->stride ||
+		(s->index = (trace_index_t *)malloc(hdr.index_len * 
+					sizeof(trace_index_t) + 1)) == NULL ||
+		fseeko(s->f, hdr.index_off, SEEK_SET) < 0 ||
+		fread(s->index, sizeof(trace_index_t), hdr.index_len, s->f) != 
+		hdr.index_len)
+		trace_error("Could not read the index of", s->path);
+	}
+	if (fseeko(s->f, s->ops_off, SEEK_SET) < 0)
+	    trace_error("Could not seek in trace", s->path);
+	return format;
+    }
+
+    rewind(s->f);
+    if (fscanf(s->f, "%d", &(trace->sugg_heapsize)) != 1 || /* not used */
+	fscanf(s->f, "%d", &(trace->num_ids)) != 1 ||
+	fscanf(s->f, "%d", &(trace->num_ops)) != 1 ||
+	fscanf(s->f, "%d", &(trace->weight)) != 1 ||        /* not used */
+	trace->num_ids < 0 || trace->num_ops < 0)
+	trace_error("Bad trace header in", s->path);
+    s->ops_off = ftello(s->f);
+    return TEXT;
+}
+
+/*
+ * read_ops - read the next n ops of the trace of s into ops, from its
+ *    file position. Returns the number read, fewer than n only at the
+ *    end of the file.
+ */
+static int read_ops(trace_stream_t *s, traceop_t *ops, int n)
+{
+    switch (s->format) {
+    case BINARY:
+	n = fread(ops, sizeof(traceop_t), n, s->f);
+	break;
+    case TEXT:
+	n = parse_ops(s, ops, n);
+	break;
+    default:
+	n = decode_ops(s, ops, n);
+    }
+    s->pos += n;
+    return n;
+}
+
+/*
+ * parse_ops - parse up to n request lines of a text trace from the file
+ *    of s into ops, and their threads into s->tids if it is set. Returns
+ *    the number parsed, fewer than n only at the end of the file.
+ */
+static int parse_ops(trace_stream_t *s, traceop_t *ops, int n)
+{
+    FILE *f = s->f;
+    const char *path = s->path;
+    char type[MAXLINE];
+    unsigned index, size, tid;
+    int i;
+
+    for (i = 0; i < n && fscanf(f, "%s", type) != EOF; i++) {
+	while (type[0] == 't') {  /* the ops from here on are tid's */
+	    if (fscanf(f, "%u", &tid) != 1 || tid >= TRACE_MAX_THREADS) {
+		printf("Bad thread in tracefile %s\n", path);
+		exit(1);
+	    }
+	    s->tid = tid;
+	    if (s->tid > s->max_tid)
+		s->max_tid = s->tid;
+	    if (fscanf(f, "%s", type) == EOF)
+		return i;
+	}
+	if (s->tids != NULL)
+	    s->tids[s->pos + i] = s->tid;
+	size = 0;
+	switch(type[0]) {
+	case 'a':
+	    fscanf(f, "%u %u", &index, &size);
+	    ops[i].type = ALLOC;
+	    ops[i].index = index;
+	    ops[i].size = size;
+	    break;
+	case 'r':
+	    fscanf(f, "%u %u", &index, &size);
+	    ops[i].type = REALLOC;
+	    ops[i].index = index;
+	    ops[i].size = size;
+	    break;
+	case 'f':
+	    fscanf(f, "%ud", &index);
+	    ops[i].type = FREE;
+	    ops[i].index = index;
+	    ops[i].size = 0;
+	    break;
+	default:
+	    printf("Bogus type character (%c) in tracefile %s\n",
+		   type[0], path);
+	    exit(1);
+	}
+	if (index > TRACE_MAX_VALUE || size > TRACE_MAX_VALUE) {
+	    printf("Id or size too large (%u %u) in tracefile %s\n",
+		   index, size, path);
+	    exit(1);
+	}
+    }
+    return i;
+}
+
+/*
+ * decode_ops - decode up to n ops of a compressed trace from the file
+ *    position of s into ops. Returns the number decoded, fewer than n
+ *    only at the end of the file.
+ */
+static int decode_ops(trace_stream_t *s, traceop_t *ops, int n)
+{
+    FILE *f = s->f;
+    unsigned long long v;
+    int i, c;
+
+    for (i = 0; i < n; i++) {
+	if ((s->pos + i) % s->stride == 0) {  /* the coding starts afresh */
+	    s->run = 0;
+	    s->last.index = 0;
+	}
+	if (s->run == 0) {
+	    if ((c = getc_unlocked(f)) == EOF)
+		break;
+	    v = c >> 2;
+	    if (v == TAG_MAX)
+		v += get_varint(f);
+	    if ((c & 3) == RUN)
+		s->run = v + 1;
+	    else {
+		s->last.type = c & 3;
+		s->delta = (int)(v >> 1) ^ -(int)(v & 1);  /* zigzag */
+		s->last.size = (s->last.type == FREE) ? 0 : get_varint(f);
+		s->run = 1;
+	    }
+	}
+	s->run--;
+	s->last.index += s->delta;
+	ops[i] = s->last;
+    }
+    return i;
+}
+
+/*
+ * get_varint - read an unsigned number coded 7 bits a byte, low bits
+ *    first, with the top bit set on all bytes but the last
+ */
+static unsigned long long get_varint(FILE *f)
+{
+    unsigned long long v = 0;
+    int c, shift = 0;
+
+    do {
+	if ((c = getc_unlocked(f)) == EOF)
+	    return 0;
+	v |= (unsigned long long)(c & 0x7f) << shift;
+	shift += 7;
+    } while (c & 0x80);
+    return v;
+}
+
+/*
+ * put_varint - write v coded as get_varint reads it
+ */
+static void put_varint(FILE *f, unsigned long long v)
+{
+    while (v >= 0x80) {
+	putc((v & 0x7f) | 0x80, f);
+	v >>= 7;
+    }
+    putc(v, f);
+}
+
+/*
+ * put_tag - write the tag byte of an op of type type, or of a run, with 
+ *    the value v in it, or TAG_MAX and the rest of v in a varint
+ */
+static void put_tag(FILE *f, int type, unsigned long long v)
+{
+    if (v < TAG_MAX)
+	putc(type | (v << 2), f);
+    else {
+	putc(type | (TAG_MAX << 2), f);
+	put_varint(f, v - TAG_MAX);
+    }
+}
+
+/*
+ * trace_ops - return the ops of the trace from op number first on, and
+ *    set *end to the number of the op after the last one returned. A 
+ *    trace in memory is returned whole. A streamed trace is returned a
+ *    chunk at a time, and the chunk stays valid until the next call; 
+ *    asking for any op but the one after the last chunk seeks to it.
+ */
+const traceop_t *trace_ops(trace_t *trace, int first, int *end)
+{
+    trace_stream_t *s = trace->stream;
+    int b;
+
+    if (s == NULL) {
+	*end = trace->num_ops;
+	return trace->ops + first;
+    }
+
+    /* A pass that fits in the ring starts again: keep it there */
+    if (!s->pinned && first == s->start && s->handed > 0 && 
+	s->handed <= TRACE_SLOTS)
+	stream_pin(s);
+    if (s->pinned) {
+	for (b = 0; b < s->pinned; b++) {
+	    if (s->at[b] == first && s->len[b] > 0) {
+		*end = first + s->len[b];
+		return s->buf[b];
+	    }
+	}
+	s->pinned = 0;  /* ops outside the kept pass: stream them again */
+    }
+
+    /* Give the last chunk back to the thread to fill */
+    pthread_mutex_lock(&s->lock);
+    if (s->held >= 0) {
+	s->len[s->held] = -1;
+	s->held = -1;
+	pthread_cond_broadcast(&s->cond);
+    }
+
+    /* Take the next chunk, if it is the one asked for, or else seek */
+    while (s->running && s->len[s->use] < 0)
+	pthread_cond_wait(&s->cond, &s->lock);
+    if (!s->running || s->at[s->use] != first) {
+	pthread_mutex_unlock(&s->lock);
+	stream_seek(s, first);
+	pthread_mutex_lock(&s->lock);
+	while (s->len[s->use] < 0)
+	    pthread_cond_wait(&s->cond, &s->lock);
+    }
+    b = s->use;
+    if (s->len[b] == 0) {
+	errno = 0;
+	trace_error("Fewer ops than the header says in", s->path);
+    }
+    s->held = b;
+    s->handed++;
+    s->use = (s->use + 1) % TRACE_SLOTS;
+    *end = first + s->len[b];
+    pthread_mutex_unlock(&s->lock);
+    return s->buf[b];
+}
+
+/*
+ * trace_keep - read ops [first, last) of a streamed trace into memory
+ *    now, if they fit in the ring, so that trace_ops returns them from
+ *    there without reading or decoding them again
+ */
+void trace_keep(trace_t *trace, int first, int last)
+{
+    trace_stream_t *s = trace->stream;
+
+    if (s == NULL || last - first > TRACE_SLOTS * TRACE_CHUNK)
+	return;
+    if (last > s->num_ops)
+	last = s->num_ops;
+    stream_stop(s);
+    s->start = first;
+    s->handed = (last - first + TRACE_CHUNK - 1) / TRACE_CHUNK;
+    stream_pin(s);
+}
+
+/*
+ * stream_seek - restart the thread of a stream at op number first
+ */
+static void stream_seek(trace_stream_t *s, int first)
+{
+    int i;
+
+    stream_stop(s);
+    alloc_ring(s);
+    s->start = first;
+    s->handed = s->pinned = 0;
+    stream_position(s, first);
+    for (i = 0; i < TRACE_SLOTS; i++)
+	s->len[i] = -1;
+    s->fill = s->use = 0;
+    s->held = -1;
+    s->stop = 0;
+    if (pthread_create(&s->thread, NULL, read_ahead, s) != 0)
+	trace_error("Could not start the reader thread for", s->path);
+    s->running = 1;
+}
+
+/*
+ * stream_pin - stop the thread of a stream, and read the chunks handed
+ *    out since the last seek into the ring, to keep there for trace_ops
+ */
+static void stream_pin(trace_stream_t *s)
+{
+    int b;
+
+    stream_stop(s);
+    alloc_ring(s);
+    stream_position(s, s->start);
+    for (b = 0; b < s->handed; b++) {
+	s->at[b] = s->pos + s->skip;
+	s->len[b] = read_chunk(s, s->buf[b]);
+    }
+    s->held = -1;
+    s->pinned = s->handed;
+}
+
+/*
+ * alloc_ring - allocate the chunks of the ring of a stream, on first use
+ */
+static void alloc_ring(trace_stream_t *s)
+{
+    int i;
+
+    if (s->buf[0] != NULL)
+	return;
+    if ((s->buf[0] = (traceop_t *)malloc(TRACE_SLOTS * TRACE_CHUNK * 
+					 sizeof(traceop_t))) == NULL)
+	trace_error("malloc failed in alloc_ring", s->path);
+    for (i = 1; i < TRACE_SLOTS; i++)
+	s->buf[i] = s->buf[0] + i * TRACE_CHUNK;
+}
+
+/*
+ * stream_position - set the file of a stream to read op number first 
+ *    next: a binary op is found by its number, a compressed one from the
+ *    index entry before it, and a text one by reading past those before
+ *    it. The ops to read past are left in skip, for read_chunk.
+ */
+static void stream_position(trace_stream_t *s, int first)
+{
+    off_t off = s->ops_off;
+    int pos = 0;
+
+    if (s->format == TEXT && first >= s->pos)
+	pos = s->pos;  /* read on from here */
+    else {
+	if (s->format == BINARY) {
+	    pos = first;
+	    off += (off_t)first * sizeof(traceop_t);
+	}
+	else if (s->format == COMPRESSED) {
+	    pos = first - first % s->stride;
+	    off = s->index[first / s->stride].off;
+	}
+	if (fseeko(s->f, off, SEEK_SET) < 0)
+	    trace_error("Could not seek in trace", s->path);
+    }
+    s->pos = pos;
+    s->skip = first - pos;
+}
+
+/*
+ * stream_stop - stop the thread of a stream and wait for it to finish
+ */
+static void stream_stop(trace_stream_t *s)
+{
+    if (!s->running)
+	return;
+    pthread_mutex_lock(&s->lock);
+    s->stop = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+    s->running = 0;
+}
+
+/*
+ * stream_close - stop a stream and free it
+ */
+static void stream_close(trace_stream_t *s)
+{
+    stream_stop(s);
+    fclose(s->f);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->buf[0]);
+    free(s->index);
+    free(s->path);
+    free(s);
+}
+
+/*
+ * read_ahead - the thread of a stream: fill the chunks of the ring in 
+ *    turn as they are given back, starting over at the end of the 
+ *    trace, until told to stop. A chunk of no ops means the file ended
+ *    before the trace did.
+ */
+static void *read_ahead(void *arg)
+{
+    trace_stream_t *s = (trace_stream_t *)arg;
+    int b, n, at;
+
+    pthread_mutex_lock(&s->lock);
+    while (1) {
+	while (!s->stop && s->len[s->fill] >= 0)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	if (s->stop)
+	    break;
+	b = s->fill;
+	pthread_mutex_unlock(&s->lock);
+
+	/* Only this thread uses the file while it runs */
+	if (s->pos + s->skip >= s->num_ops)
+	    stream_position(s, s->start);
+	at = s->pos + s->skip;
+	n = read_chunk(s, s->buf[b]);
+
+	pthread_mutex_lock(&s->lock);
+	s->at[b] = at;
+	s->len[b] = n;
+	s->fill = (s->fill + 1) % TRACE_SLOTS;
+	pthread_cond_broadcast(&s->cond);
+	if (n == 0)
+	    break;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/*
+ * read_chunk - read the next chunk of a stream into ops, first reading
+ *    past the ops to skip. Returns the number of ops read.
+ */
+static int read_chunk(trace_stream_t *s, traceop_t *ops)
+{
+    int n;
+
+    while (s->skip > 0) {
+	n = (s->skip < TRACE_CHUNK) ? s->skip : TRACE_CHUNK;
+	if ((n = read_ops(s, ops, n)) == 0)
+	    return 0;
+	s->skip -= n;
+    }
+    n = s->num_ops - s->pos;
+    if (n > TRACE_CHUNK)
+	n = TRACE_CHUNK;
+    return read_ops(s, ops, n);
+}
+
+/*
+ * alloc_blocks - allocate the array the driver keeps per id, with room
+ *    for the first ids only; trace_grow makes more as the ops need it
+ */
+static void alloc_blocks(trace_t *trace)
+{
+    trace->blocks = NULL;
+    trace->max_ids = 0;
+    trace_grow(trace, TRACE_IDS_MIN - 1);
+}
+
+/*
+ * trace_grow - make room in blocks for id index, at least doubling it
+ */
+void trace_grow(trace_t *trace, int index)
+{
+    int n = (trace->max_ids > 0) ? trace->max_ids : TRACE_IDS_MIN;
+
+    while (n <= index && n < INT_MAX / 2)
+	n *= 2;
+    if (n <= index)
+	n = index + 1;
+
+    if ((trace->blocks = (traceblock_t *)realloc(trace->blocks, 
+			     n * sizeof(traceblock_t))) == NULL)
+	trace_error("realloc failed in trace_grow", "");
+    trace->max_ids = n;
+}
+
+/*
+ * trace_expand - Replace a trace by n copies of itself, interleaved
+ *    op by op, each with its own ids.
+ */
+void trace_expand(trace_t *trace, int n)
+{
+    int i, c;
+    traceop_t *ops;
+    unsigned short *tids;
+
+    if ((ops = (traceop_t *)malloc((size_t)trace->num_ops * n *
+				   sizeof(traceop_t))) == NULL)
+	trace_error("malloc failed in trace_expand", "");
+    for (i = 0; i < trace->num_ops; i++) {
+	for (c = 0; c < n; c++) {
+	    ops[i*n + c] = trace->ops[i];
+	    ops[i*n + c].index += c * trace->num_ids;
+	}
+    }
+    if (trace->tids != NULL) {  /* and each copy its own threads */
+	if ((tids = (unsigned short *)malloc((size_t)trace->num_ops * n *
+					    sizeof(unsigned short))) == NULL ||
+	    trace->num_threads * n > TRACE_MAX_THREADS)
+	    trace_error("Too many threads in trace_expand", "");
+	for (i = 0; i < trace->num_ops; i++)
+	    for (c = 0; c < n; c++)
+		tids[i*n + c] = trace->tids[i] + c * trace->num_threads;
+	free(trace->tids);
+	trace->tids = tids;
+	trace->num_threads *= n;
+    }
+    if (trace->map != NULL) {
+	munmap(trace->map, trace->map_len);
+	trace->map = NULL;
+    }
+    else
+	free(trace->ops);
+    trace->ops = ops;
+    trace->num_ops *= n;
+    trace->num_ids *= n;
+}
+
+/*
+ * trace_free - Free the trace record and the arrays it points to, or
+ *    unmap the file its ops are in, or close its stream
+ */
+void trace_free(trace_t *trace)
+{
+    if (trace->stream != NULL)
+	stream_close(trace->stream);
+    else if (trace->map != NULL)
+	munmap(trace->map, trace->map_len);
+    else
+	free(trace->ops);
+    free(trace->blocks);
+    free(trace->tids);
+    free(trace);
+}
+
+/*
+ * init_header - fill in the header of a binary or compressed trace, 
+ *    with an index entry every stride ops, or no index if stride is 0
+ */
+static void init_header(trace_hdr_t *hdr, trace_t *trace, unsigned magic,
+			unsigned op_size, int stride)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = magic;
+    hdr->version = TRACE_VERSION;
+    hdr->op_size = op_size;
+    hdr->index_stride = (stride > 0) ? stride : 0;
+    hdr->sugg_heapsize = trace->sugg_heapsize;
+    hdr->num_ids = trace->num_ids;
+    hdr->num_ops = trace->num_ops;
+    hdr->weight = trace->weight;
+    hdr->ops_off = sizeof(*hdr);
+    if (stride > 0)
+	hdr->index_len = (trace->num_ops + stride - 1) / stride;
+}
+
+/*
+ * trace_write - write a trace in the binary format, with an index entry
+ *    every stride ops, or no index if stride is 0
+ */
+void trace_write(trace_t *trace, const char *path, int stride)
+{
+    trace_hdr_t hdr;
+    trace_index_t *index = NULL;
+    const traceop_t *ops;
+    unsigned long long live = 0;
+    FILE *f;
+    int i, end;
+
+    init_header(&hdr, trace, TRACE_MAGIC, sizeof(traceop_t), stride);
+    if (stride > 0) {
+	hdr.index_off = hdr.ops_off + (unsigned long long)trace->num_ops * sizeof(traceop_t);
+	if ((index = (trace_index_t *)malloc(hdr.index_len * 
+					     sizeof(trace_index_t))) == NULL)
+	    trace_error("malloc failed in trace_write", path);
+    }
+
+    if ((f = fopen(path, "wb")) == NULL)
+	trace_error("Could not create trace", path);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	trace_error("Could not write trace", path);
+
+    /* Write the ops a chunk at a time, noting the index entries on the way */
+    for (i = 0; i < trace->num_ops; i = end) {
+	ops = trace_ops(trace, i, &end);
+	if (fwrite(ops, sizeof(traceop_t), end - i, f) != (size_t)(end - i))
+	    trace_error("Could not write trace", path);
+	for (; stride > 0 && i < end; i++, ops++) {
+	    if (i % stride == 0) {
+		index[i / stride].off = hdr.ops_off + 
+		    (unsigned long long)i * sizeof(traceop_t);
+		index[i / stride].live = live;
+	    }
+	    if (ops->type == ALLOC)
+		live++;
+	    else if (ops->type == FREE)
+		live--;
+	}
+    }
+    if (stride > 0 && 
+	fwrite(index, sizeof(trace_index_t), hdr.index_len, f) != hdr.index_len)
+	trace_error("Could not write trace", path);
+    free(index);
+    if (fclose(f) != 0)
+	trace_error("Could not write trace", path);
+    check_tags(trace, path, 0);
+}
+
+/*
+ * trace_write_compressed - write a trace in the compressed format, with
+ *    an index entry every stride ops, or every TRACE_CHUNK if stride is 0
+ */
+void trace_write_compressed(trace_t *trace, const char *path, int stride)
+{
+    trace_hdr_t hdr;
+    trace_index_t *index;
+    const traceop_t *op = NULL;
+    unsigned long long live = 0;
+    int last_type = RUN, last_index = 0, last_size = 0;
+    int delta = 0, run = 0;
+    FILE *f;
+    int i, end = 0;
+
+    if (stride <= 0)
+	stride = TRACE_CHUNK;
+    init_header(&hdr, trace, TRACE_ZMAGIC, 0, stride);
+    if ((index = (trace_index_t *)malloc(hdr.index_len * 
+					 sizeof(trace_index_t) + 1)) == NULL)
+	trace_error("malloc failed in trace_write_compressed", path);
+
+    /* The header is written again at the end, with the index offset */
+    if ((f = fopen(path, "wb")) == NULL)
+	trace_error("Could not create trace", path);
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	trace_error("Could not write trace", path);
+
+    for (i = 0; i < trace->num_ops; i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+
+	/* Start the coding afresh at each index entry */
+	if (i % stride == 0) {
+	    if (run > 0)
+		put_tag(f, RUN, run - 1);
+	    run = 0;
+	    index[i / stride].off = ftello(f);
+	    index[i / stride].live = live;
+	    last_type = RUN;  /* the next op is no repeat */
+	    last_index = 0;
+	}
+
+	/* Count the op into the run if it repeats the one before, or code it */
+	if (op->type == last_type && op->index - last_index == delta &&
+	    (op->type == FREE || op->size == last_size))
+	    run++;
+	else {
+	    if (run > 0)
+		put_tag(f, RUN, run - 1);
+	    run = 0;
+	    delta = op->index - last_index;
+	    put_tag(f, op->type, ((unsigned)delta << 1) ^ (unsigned)(delta >> 31));
+	    if (op->type != FREE)
+		put_varint(f, op->size);
+	    last_type = op->type;
+	    last_size = op->size;
+	}
+	last_index = op->index;
+
+	if (op->type == ALLOC)
+	    live++;
+	else if (op->type == FREE)
+	    live--;
+    }
+    if (run > 0)
+	put_tag(f, RUN, run - 1);
+
+    hdr.index_off = ftello(f);
+    if (fwrite(index, sizeof(trace_index_t), hdr.index_len, f) != hdr.index_len ||
+	fseeko(f, 0, SEEK_SET) < 0 || fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+	trace_error("Could not write trace", path);
+    free(index);
+    if (fclose(f) != 0)
+	trace_error("Could not write trace", path);
+    check_tags(trace, path, 0);
+}
+
+/*
+ * trace_write_text - write a trace in the .rep text format, with the
+ *    thread of each op if it has them
+ */
+void trace_write_text(trace_t *trace, const char *path)
+{
+    const traceop_t *op = NULL;
+    FILE *f;
+    int i, end = 0, tid = -1;
+
+    if ((f = fopen(path, "w")) == NULL)
+	trace_error("Could not create trace", path);
+    fprintf(f, "%d\n%d\n%d\n%d\n", trace->sugg_heapsize, trace->num_ids,
+	    trace->num_ops, trace->weight);
+    for (i = 0; i < trace->num_ops; i++, op++) {
+	if (i == end)
+	    op = trace_ops(trace, i, &end);
+	if (trace->tids != NULL && trace->tids[i] != tid) {
+	    tid = trace->tids[i];
+	    fprintf(f, "t %d\n", tid);
+	}
+	switch (op->type) {
+	case ALLOC:
+	    fprintf(f, "a %d %d\n", op->index, op->size);
+	    break;
+	case REALLOC:
+	    fprintf(f, "r %d %d\n", op->index, op->size);
+	    break;
+	case FREE:
+	    fprintf(f, "f %d\n", op->index);
+	    break;
+	}
+    }
+    if (fclose(f) != 0)
+	trace_error("Could not write trace", path);
+    check_tags(trace, path, 1);
+}
+
+/*
+ * check_tags - remove the trace just written to path, and stop with an
+ *    error, if it left out thread tags: those of a trace in memory, in 
+ *    any format but text, or those a stream read past, in any format
+ */
+static void check_tags(trace_t *trace, const char *path, int text)
+{
+    trace_stream_t *s = trace->stream;
+
+    if (s != NULL)
+	stream_stop(s);  /* so that the thread is done with max_tid */
+    if ((trace->tids != NULL && !text) || (s != NULL && s->max_tid >= 0)) {
+	remove(path);
+	errno = 0;
+	trace_error("Thread tags cannot be kept in", path);
+    }
+}
+
+/*
+ * trace_error - report an error on a trace file and terminate
+ */
+static void trace_error(const char *msg, const char *path)
+{
+    if (errno != 0)
+	fprintf(stderr, "%s %s: %s\n", msg, path, strerror(errno));
+    else
+	fprintf(stderr, "%s %s\n", msg, path);
+    exit(1);
+}
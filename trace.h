@@ -0,0 +1,105 @@
+/*
+ * trace.h - reading and writing allocator traces, in the text format of
+ *     the .rep files, in a binary format that is mapped as it is on disk,
+ *     or in a compressed format that is decoded as it is read.
+ *     A trace is either read into memory whole, or streamed from disk a
+ *     chunk at a time; the ops of either are reached through trace_ops.
+ */
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stddef.h>
+
+/*
+ * Characterizes a single trace operation (allocator request), packed in
+ * 64 bits, so that the ops of a trace take little cache as they stream
+ * by. An id or size is a nonnegative int, so 31 bits hold any of them.
+ * This is also the layout of an op in a binary trace, in host byte order.
+ */
+enum {ALLOC, FREE, REALLOC};               /* types of request */
+
+typedef struct {
+    unsigned long long type : 2;           /* type of request */
+    unsigned long long index : 31;         /* index for free() to use later */
+    unsigned long long size : 31;          /* byte size of alloc/realloc request */
+} traceop_t;
+
+#define TRACE_MAX_VALUE 0x7fffffff  /* largest id or size an op holds */
+#define TRACE_MAX_THREADS 65536     /* threads a text trace can tag ops with */
+
+/* The block the driver holds for an id, its address next to its size */
+typedef struct {
+    char *p;             /* ptr returned by malloc/realloc... */
+    size_t size;         /* ... and its payload size */
+} traceblock_t;
+
+typedef struct trace_stream trace_stream_t;
+
+/* Holds the information for one trace file*/
+typedef struct {
+    int sugg_heapsize;   /* suggested heap size (unused) */
+    int num_ids;         /* number of alloc/realloc ids */
+    int num_ops;         /* number of distinct requests */
+    int weight;          /* weight for this trace (unused) */
+    traceop_t *ops;      /* array of requests, or NULL if streamed */
+    traceblock_t *blocks; /* the block of each id */
+    int max_ids;         /* ids that blocks has room for */
+    void *map;           /* binary trace file that ops points into, or NULL */
+    size_t map_len;
+    trace_stream_t *stream; /* reader of a streamed trace, or NULL */
+    unsigned short *tids; /* thread of each op, or NULL if the trace has none */
+    int num_threads;     /* 1 + the largest thread in tids */
+} trace_t;
+
+#define TRACE_CHUNK   65536  /* ops per chunk of a streamed trace */
+#define TRACE_IDS_MIN 1024   /* ids that blocks has room for at first */
+
+/* Make room in blocks for id index */
+#define TRACE_NEED(trace, index) \
+    do { if ((index) >= (trace)->max_ids) trace_grow(trace, index); } while (0)
+
+#define TRACE_MAGIC   0x72746d6d  /* "mmtr", first word of a binary trace */
+#define TRACE_ZMAGIC  0x7a746d6d  /* "mmtz", first word of a compressed one */
+#define TRACE_VERSION 2  /* 1 had 12-byte ops */
+
+/*
+ * The header of a binary trace. The ops follow at ops_off, num_ops of
+ * op_size bytes each, and the index, if any, at index_off. A compressed
+ * trace has the same header, with op_size 0, and always an index.
+ */
+typedef struct {
+    unsigned int magic;              /* TRACE_MAGIC */
+    unsigned int version;            /* TRACE_VERSION */
+    unsigned int op_size;            /* sizeof(traceop_t) */
+    unsigned int index_stride;       /* ops between index entries, 0 for no index */
+    int sugg_heapsize;               /* the four numbers of a .rep header */
+    int num_ids;
+    int num_ops;
+    int weight;
+    unsigned long long ops_off;      /* file offset of the first op */
+    unsigned long long index_off;    /* file offset of the index */
+    unsigned long long index_len;    /* number of index entries */
+} trace_hdr_t;
+
+/*
+ * An entry of the index, one per index_stride ops: where op number
+ * k * index_stride starts, and how many blocks are live before it, so
+ * that a reader can start part way into a trace
+ */
+typedef struct {
+    unsigned long long off;          /* file offset of the op */
+    unsigned long long live;         /* blocks allocated and not yet freed */
+} trace_index_t;
+
+trace_t *trace_read(const char *path);
+trace_t *trace_open(const char *path);
+const traceop_t *trace_ops(trace_t *trace, int first, int *end);
+void trace_keep(trace_t *trace, int first, int last);
+void trace_grow(trace_t *trace, int index);
+void trace_expand(trace_t *trace, int n);
+void trace_free(trace_t *trace);
+void trace_write(trace_t *trace, const char *path, int stride);
+void trace_write_compressed(trace_t *trace, const char *path, int stride);
+void trace_write_text(trace_t *trace, const char *path);
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,55 @@
+/*
+ * traceconv.c - converts a trace to the binary format that mdriver maps
+ *     without parsing, with -z to the compressed format, or with -t back 
+ *     to the .rep text format. The input may be in any of the formats.
+ *
+ * With -i, the binary trace gets an index entry every <stride> ops. A
+ * compressed trace always has one, every 65536 ops unless -i says.
+ * A text trace with thread tags (see trace.c) is not converted: the
+ * other formats cannot hold them, and the trace is streamed, so -t 
+ * cannot keep them either. traceconv stops with an error instead.
+ *
+ * usage: traceconv [-t | -z] [-i <stride>] <in> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+int main(int argc, char **argv)
+{
+    int c, text = 0, compress = 0, stride = 0;
+    trace_t *trace;
+
+    while ((c = getopt(argc, argv, "tzi:h")) != EOF) {
+	switch (c) {
+	case 't':
+	    text = 1;
+	    break;
+	case 'z':
+	    compress = 1;
+	    break;
+	case 'i':
+	    stride = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: traceconv [-t | -z] [-i <stride>] <in> <out>\n");
+	    exit(c == 'h' ? 0 : 1);
+	}
+    }
+    if (argc - optind != 2 || stride < 0 || (text && compress)) {
+	fprintf(stderr, "usage: traceconv [-t | -z] [-i <stride>] <in> <out>\n");
+	exit(1);
+    }
+
+    trace = trace_open(argv[optind]);  /* streamed, so any length converts */
+    if (text)
+	trace_write_text(trace, argv[optind + 1]);
+    else if (compress)
+	trace_write_compressed(trace, argv[optind + 1], stride);
+    else
+	trace_write(trace, argv[optind + 1], stride);
+    trace_free(trace);
+    return 0;
+}
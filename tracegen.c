@@ -0,0 +1,680 @@
+/*
+ * tracegen.c - generates synthetic traces, deterministically from a seed,
+ *     either from a preset that reproduces the shape of one of the classic
+ *     lab traces at some scale, or from models of the request sizes, the
+ *     block lifetimes, program phases and realloc growth:
+ *
+ *         unix> tracegen -p binary -x 100 binary-100.rep
+ *         unix> tracegen -n 100000 -S power:8:4096:1.2 -L exp:2000 \
+ *                   -P 8:0.5 -R 0.05:1.5 -z model.z
+ *
+ * A distribution (the -S sizes or -L lifetimes) is one of
+ *
+ *     uniform:<lo>:<hi>          every value in [lo, hi] as likely
+ *     power:<lo>:<hi>:<alpha>    bounded power law, P(x) ~ x^-(alpha+1)
+ *     bimodal:<a>:<b>:<p>        a with probability p, else b
+ *     exp:<mean>                 exponential
+ *     hist:<file>                drawn from "<value> <count>" lines
+ *
+ * Lifetimes count allocations: a block allocated with lifetime L is
+ * freed once L more blocks have been allocated. With -P n:f[:s], the
+ * trace has n phases, a fraction f of the blocks die together at the end
+ * of the phase they are born in, and odd phases scale sizes by s. With
+ * -R p:g[:d], each request is with probability p a realloc of a random
+ * live block to g times its size plus d. Every block is freed by the end.
+ *
+ * With -T n[:p], the ops are spread over n threads for mtreplay: each
+ * block is allocated and reallocated by a random thread, and freed by
+ * it too, or with probability p by another one. The ops are the same as
+ * without -T, tagged with "t tid" lines (see trace.c).
+ *
+ * The output is a .rep text trace, or binary with -b, compressed with -z.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024  /* max string size */
+
+/* The kinds of distribution */
+enum {UNIFORM, POWER, BIMODAL, EXPONENTIAL, HISTOGRAM};
+
+/* A distribution of sizes or lifetimes */
+typedef struct {
+    int kind;
+    double a, b, c;      /* the parameters, in the order they are given */
+    int n;               /* histogram: number of values... */
+    double *values;      /* ... the values... */
+    double *cum;         /* ... and their cumulative weights */
+} dist_t;
+
+/* The parameters of a model trace */
+typedef struct {
+    dist_t size;         /* request sizes */
+    dist_t life;         /* lifetimes, in allocations */
+    int phases;          /* phases of the trace */
+    double phase_frac;   /* fraction of blocks that die at their phase end */
+    double phase_scale;  /* odd phases scale sizes by this */
+    double realloc_p;    /* probability that a request is a realloc... */
+    double growth;       /* ... of a live block to growth times its size... */
+    int step;            /* ... plus step bytes */
+} model_t;
+
+/* A preset: a pattern generator, or a model, and its allocations at x1 */
+typedef struct {
+    char *name;
+    void (*pattern)(int scale);
+    char *size, *life;
+    int phases;
+    double phase_frac, phase_scale, realloc_p, growth;
+    int allocs;
+    char *desc;
+} preset_t;
+
+static void gen_binary(int scale);
+static void gen_binary2(int scale);
+static void gen_coalescing(int scale);
+static void gen_realloc(int scale);
+static void gen_realloc2(int scale);
+static void gen_prodcons(int scale);
+
+static preset_t presets[] = {
+    {"binary", gen_binary, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "64 and 448 byte pairs, the 448s freed, then 512s"},
+    {"binary2", gen_binary2, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "16 and 112 byte pairs, the 112s freed, then 128s"},
+    {"coalescing", gen_coalescing, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "two 4095 byte blocks freed and reused as one 8190"},
+    {"realloc", gen_realloc, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "one block grown by 128 bytes between 128 byte blocks"},
+    {"realloc2", gen_realloc2, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "one block grown by 5 bytes between 16 byte blocks"},
+    {"prodcons", gen_prodcons, NULL, NULL, 0, 0, 0, 0, 0, 0,
+     "messages made in bursts and freed in bursts, oldest first"},
+    {"random", NULL, "uniform:1:32767", "uniform:1:1200", 1, 0, 1, 0, 0, 2400,
+     "sizes and lifetimes uniformly random"},
+    {"random2", NULL, "uniform:1:16383", "uniform:1:1200", 1, 0, 1, 0, 0, 2400,
+     "like random, with sizes up to 16K"},
+    {"amptjp", NULL, "power:8:16384:0.5", "power:1:5000:0.6", 6, 0.6, 1, 0, 0, 4800,
+     "a program: small sizes, heavy-tailed lifetimes, phases"},
+    {"cccp", NULL, "power:8:4096:0.6", "power:1:6000:0.5", 4, 0.5, 1, 0, 0, 5800,
+     "a program: a compiler's small objects in passes"},
+    {"cp-decl", NULL, "power:16:8192:0.5", "power:1:8000:0.4", 8, 0.4, 1, 0, 0, 6600,
+     "a program: declarations kept to the end of passes"},
+    {"expr", NULL, "power:8:2048:0.8", "exp:500", 3, 0.3, 1, 0, 0, 5400,
+     "a program: short-lived expression nodes"},
+    {"growth", NULL, "power:16:4096:1.0", "exp:2000", 4, 0.3, 1, 0.1, 1.5, 20000,
+     "a program whose buffers grow by realloc"},
+    {"fragment", NULL, "power:8:65536:0.4", "power:1:100000:0.3", 16, 0.2, 4, 0, 0, 20000,
+     "long-running: wide sizes, lifetimes and phases fragment the heap"},
+    {NULL}
+};
+
+static unsigned long long seed = 1;
+
+/* The trace as it is generated */
+static traceop_t *ops = NULL;
+static int num_ops = 0, max_ops = 0;
+static int num_ids = 0;
+static int *sizes = NULL;          /* size of each id */
+static int max_ids = 0;
+static long long live_bytes = 0, peak_bytes = 0;
+
+static void gen_model(model_t *m, int allocs);
+static unsigned short *gen_threads(int threads, double remote_p);
+static int alloc_op(int size);
+static void realloc_op(int id, int size);
+static void free_op(int id);
+static void emit(int type, int id, int size);
+static void parse_dist(dist_t *d, char *spec);
+static double draw(dist_t *d);
+static double rnd(void);
+static void usage(void);
+static void gen_error(char *msg, char *arg);
+
+int main(int argc, char **argv)
+{
+    int c, i, scale = 1, allocs = 0, format = 0, threads = 0;
+    double remote_p = 0;
+    char *preset = NULL;
+    char *size = NULL, *life = NULL;
+    model_t m;
+    preset_t *p = NULL;
+    trace_t *trace;
+
+    memset(&m, 0, sizeof(m));
+    m.phases = 1;
+    m.phase_scale = 1;
+    m.growth = 1;
+    while ((c = getopt(argc, argv, "p:x:n:s:S:L:P:R:T:bzlh")) != EOF) {
+	switch (c) {
+	case 'p':
+	    preset = optarg;
+	    break;
+	case 'x':
+	    scale = atoi(optarg);
+	    break;
+	case 'n':
+	    allocs = atoi(optarg);
+	    break;
+	case 's':
+	    seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'S':
+	    size = optarg;
+	    break;
+	case 'L':
+	    life = optarg;
+	    break;
+	case 'P':
+	    if (sscanf(optarg, "%d:%lf:%lf", &m.phases, &m.phase_frac,
+		       &m.phase_scale) < 2 || m.phases < 1 ||
+		m.phase_frac < 0 || m.phase_frac > 1 || m.phase_scale <= 0)
+		gen_error("-P needs <phases>:<fraction>[:<scale>], not", optarg);
+	    break;
+	case 'R':
+	    if (sscanf(optarg, "%lf:%lf:%d", &m.realloc_p, &m.growth,
+		       &m.step) < 2 || m.realloc_p < 0 || m.realloc_p >= 1 ||
+		m.growth <= 0)
+		gen_error("-R needs <probability>:<growth>[:<step>], not", optarg);
+	    break;
+	case 'T':
+	    if (sscanf(optarg, "%d:%lf", &threads, &remote_p) < 1 ||
+		threads < 1 || threads > TRACE_MAX_THREADS ||
+		remote_p < 0 || remote_p > 1)
+		gen_error("-T needs <threads>[:<probability>], not", optarg);
+	    break;
+	case 'b':
+	    format = 'b';
+	    break;
+	case 'z':
+	    format = 'z';
+	    break;
+	case 'l':
+	    for (i = 0; presets[i].name != NULL; i++)
+		printf("%-12s%s\n", presets[i].name, presets[i].desc);
+	    exit(0);
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (argc - optind != 1 || scale < 1 || allocs < 0) {
+	usage();
+	exit(1);
+    }
+    if (threads > 0 && format != 0)
+	gen_error("-T needs a text trace, not", format == 'b' ? "-b" : "-z");
+
+    /* A preset sets whatever the options have not */
+    if (preset != NULL) {
+	for (p = presets; p->name != NULL && strcmp(p->name, preset); p++)
+	    ;
+	if (p->name == NULL)
+	    gen_error("No preset named", preset);
+	if (p->pattern == NULL) {
+	    size = (size != NULL) ? size : p->size;
+	    life = (life != NULL) ? life : p->life;
+	    if (m.phases == 1 && m.phase_frac == 0) {
+		m.phases = p->phases;
+		m.phase_frac = p->phase_frac;
+		m.phase_scale = p->phase_scale;
+	    }
+	    if (m.realloc_p == 0) {
+		m.realloc_p = p->realloc_p;
+		m.growth = p->growth;
+	    }
+	    allocs = (allocs > 0) ? allocs : p->allocs;
+	}
+    }
+
+    if (p != NULL && p->pattern != NULL)
+	p->pattern(scale);
+    else {
+	parse_dist(&m.size, (size != NULL) ? size : "uniform:1:4096");
+	parse_dist(&m.life, (life != NULL) ? life : "exp:1000");
+	gen_model(&m, ((allocs > 0) ? allocs : 10000) * scale);
+    }
+
+    if ((trace = (trace_t *)calloc(1, sizeof(trace_t))) == NULL)
+	gen_error("calloc failed in", "main");
+    trace->sugg_heapsize = (peak_bytes < TRACE_MAX_VALUE) ? peak_bytes : TRACE_MAX_VALUE;
+    trace->num_ids = num_ids;
+    trace->num_ops = num_ops;
+    trace->weight = 1;
+    trace->ops = ops;
+    if (threads > 0) {
+	trace->tids = gen_threads(threads, remote_p);
+	trace->num_threads = threads;
+    }
+    if (format == 'b')
+	trace_write(trace, argv[optind], 0);
+    else if (format == 'z')
+	trace_write_compressed(trace, argv[optind], 0);
+    else
+	trace_write_text(trace, argv[optind]);
+    trace_free(trace);
+    free(sizes);
+    return 0;
+}
+
+/*
+ * gen_binary - the binary-bal shape: pairs of a small and a large block,
+ *    all the large ones freed, then blocks a bit larger than the large
+ *    ones, which cannot use the holes left between the small ones
+ */
+static void gen_binary(int scale)
+{
+    int i, n = 2000 * scale, first = num_ids;
+
+    for (i = 0; i < n; i++) {
+	alloc_op(64);
+	alloc_op(448);
+    }
+    for (i = 0; i < n; i++)
+	free_op(first + 2*i + 1);
+    for (i = 0; i < n; i++)
+	alloc_op(512);
+    for (i = 0; i < n; i++)
+	free_op(first + 2*i);
+    for (i = 0; i < n; i++)
+	free_op(first + 2*n + i);
+}
+
+/*
+ * gen_binary2 - the binary2-bal shape, with smaller blocks
+ */
+static void gen_binary2(int scale)
+{
+    int i, n = 4000 * scale, first = num_ids;
+
+    for (i = 0; i < n; i++) {
+	alloc_op(16);
+	alloc_op(112);
+    }
+    for (i = 0; i < n; i++)
+	free_op(first + 2*i + 1);
+    for (i = 0; i < n; i++)
+	alloc_op(128);
+    for (i = 0; i < n; i++)
+	free_op(first + 2*i);
+    for (i = 0; i < n; i++)
+	free_op(first + 2*n + i);
+}
+
+/*
+ * gen_coalescing - the coalescing-bal shape: two neighbors freed, and a
+ *    block the size of both, which fits only if they were coalesced
+ */
+static void gen_coalescing(int scale)
+{
+    int i, a, b, n = 2400 * scale;
+
+    for (i = 0; i < n; i++) {
+	a = alloc_op(4095);
+	b = alloc_op(4095);
+	free_op(a);
+	free_op(b);
+	free_op(alloc_op(8190));
+    }
+}
+
+/*
+ * grow - one block realloc'ed step bytes larger at a time, with a small
+ *    block allocated after each realloc and the one before it freed, as
+ *    in the realloc-bal traces
+ */
+static void grow(int n, int start, int step, int small)
+{
+    int i, big, last;
+
+    big = alloc_op(start);
+    last = alloc_op(small);
+    for (i = 0; i < n; i++) {
+	realloc_op(big, (start + (long long)(i + 1) * step < TRACE_MAX_VALUE) ?
+		   start + (i + 1) * step : TRACE_MAX_VALUE);
+	free_op(last);
+	last = alloc_op(small);
+    }
+    free_op(last);
+    free_op(big);
+}
+
+/*
+ * gen_realloc, gen_realloc2 - the realloc-bal shapes, once per scale: each
+ *    block grows as far as in the classic trace and is then freed, so the
+ *    work and the ops grow with the scale but the heap does not
+ */
+static void gen_realloc(int scale)
+{
+    int i;
+
+    for (i = 0; i < scale; i++)
+	grow(4800, 512, 128, 128);
+}
+
+static void gen_realloc2(int scale)
+{
+    int i;
+
+    for (i = 0; i < scale; i++)
+	grow(4800, 4092, 5, 16);
+}
+
+/*
+ * gen_prodcons - a producer and a consumer sharing a queue of messages:
+ *    the producer allocates a burst of messages, the consumer frees a
+ *    burst of the oldest, and the queue holds at most 4096
+ */
+static void gen_prodcons(int scale)
+{
+    int n = 12000 * scale, queue_max = 4096;
+    int *queue, head = 0, tail = 0, made = 0, burst;
+
+    if ((queue = (int *)malloc(queue_max * sizeof(int))) == NULL)
+	gen_error("malloc failed in", "gen_prodcons");
+    while (made < n || head != tail) {
+	for (burst = 1 + rnd() * 64; burst > 0 && made < n && 
+		 tail - head < queue_max; burst--, made++)
+	    queue[tail++ % queue_max] = alloc_op(32 + rnd() * 2016);
+	for (burst = 1 + rnd() * 64; burst > 0 && head != tail; burst--)
+	    free_op(queue[head++ % queue_max]);
+    }
+    free(queue);
+}
+
+/*
+ * gen_model - generate a trace of allocs allocations from the model m.
+ *    The live blocks are kept in a heap ordered by when they die, and in
+ *    an array that realloc picks from at random.
+ */
+static void gen_model(model_t *m, int allocs)
+{
+    long long *death;            /* the heap: when each block dies... */
+    int *hid;                    /* ... and its id */
+    int *live, *pos;             /* the live ids, and where each is in live */
+    int n = 0, nlive = 0;
+    int t, k, j, id, size, phase;
+    int phase_len = (allocs + m->phases - 1) / m->phases;
+    long long d, newsize;
+
+    if ((death = (long long *)malloc(allocs * sizeof(long long) + 1)) == NULL ||
+	(hid = (int *)malloc(allocs * sizeof(int) + 1)) == NULL ||
+	(live = (int *)malloc(allocs * sizeof(int) + 1)) == NULL ||
+	(pos = (int *)malloc(allocs * sizeof(int) + 1)) == NULL)
+	gen_error("malloc failed in", "gen_model");
+
+    for (t = 0; t < allocs || n > 0; ) {
+	/* Free the blocks whose time has come, or all of them at the end */
+	if (n > 0 && (death[0] <= t || t == allocs)) {
+	    id = hid[0];
+	    free_op(id);
+	    k = pos[id];
+	    live[k] = live[--nlive];
+	    pos[live[k]] = k;
+
+	    /* Sift the last block of the heap down from the top */
+	    d = death[--n];
+	    for (k = 0; (j = 2*k + 1) < n; k = j) {
+		if (j + 1 < n && death[j + 1] < death[j])
+		    j++;
+		if (d <= death[j])
+		    break;
+		death[k] = death[j];
+		hid[k] = hid[j];
+	    }
+	    death[k] = d;
+	    hid[k] = hid[n];
+	    continue;
+	}
+
+	/* Grow a live block */
+	if (nlive > 0 && rnd() < m->realloc_p) {
+	    id = live[(int)(rnd() * nlive)];
+	    newsize = (long long)(sizes[id] * m->growth) + m->step;
+	    realloc_op(id, (newsize < 1) ? 1 :
+		       (newsize > TRACE_MAX_VALUE) ? TRACE_MAX_VALUE : newsize);
+	    continue;
+	}
+
+	/* Allocate a block, and decide when it dies */
+	phase = t / phase_len;
+	d = (long long)(draw(&m->size) * ((phase & 1) ? m->phase_scale : 1));
+	size = (d < 1) ? 1 : (d > TRACE_MAX_VALUE) ? TRACE_MAX_VALUE : d;
+	id = alloc_op(size);
+	if (m->phase_frac > 0 && rnd() < m->phase_frac)
+	    d = (long long)(phase + 1) * phase_len;
+	else
+	    d = t + 1 + (long long)draw(&m->life);
+	live[nlive] = id;
+	pos[id] = nlive++;
+
+	/* Sift the new block up the heap */
+	for (k = n++; k > 0 && death[(k - 1) / 2] > d; k = (k - 1) / 2) {
+	    death[k] = death[(k - 1) / 2];
+	    hid[k] = hid[(k - 1) / 2];
+	}
+	death[k] = d;
+	hid[k] = id;
+	t++;
+    }
+    free(death);
+    free(hid);
+    free(live);
+    free(pos);
+}
+
+/*
+ * gen_threads - return the thread of each op of the trace: the thread
+ *    that allocated the block, picked at random, except for frees that go
+ *    to another thread with probability remote_p
+ */
+static unsigned short *gen_threads(int threads, double remote_p)
+{
+    unsigned short *tids, *owner;
+    int i;
+
+    if ((tids = (unsigned short *)malloc(num_ops * sizeof(unsigned short) + 1)) == NULL ||
+	(owner = (unsigned short *)malloc(num_ids * sizeof(unsigned short) + 1)) == NULL)
+	gen_error("malloc failed in", "gen_threads");
+    for (i = 0; i < num_ops; i++) {
+	if (ops[i].type == ALLOC)
+	    owner[ops[i].index] = (int)(rnd() * threads);
+	tids[i] = owner[ops[i].index];
+	if (ops[i].type == FREE && threads > 1 && rnd() < remote_p)
+	    tids[i] = (tids[i] + 1 + (int)(rnd() * (threads - 1))) % threads;
+    }
+    free(owner);
+    return tids;
+}
+
+/*
+ * alloc_op - add an alloc of a new id to the trace and return the id
+ */
+static int alloc_op(int size)
+{
+    int id = num_ids++;
+
+    if (id >= max_ids) {
+	max_ids = (max_ids > 0) ? 2 * max_ids : 4096;
+	if ((sizes = (int *)realloc(sizes, max_ids * sizeof(int))) == NULL)
+	    gen_error("realloc failed in", "alloc_op");
+    }
+    sizes[id] = size;
+    live_bytes += size;
+    emit(ALLOC, id, size);
+    return id;
+}
+
+/*
+ * realloc_op - add a realloc of id to size bytes to the trace
+ */
+static void realloc_op(int id, int size)
+{
+    live_bytes += size - sizes[id];
+    sizes[id] = size;
+    emit(REALLOC, id, size);
+}
+
+/*
+ * free_op - add a free of id to the trace
+ */
+static void free_op(int id)
+{
+    live_bytes -= sizes[id];
+    emit(FREE, id, 0);
+}
+
+/*
+ * emit - append an op to the trace
+ */
+static void emit(int type, int id, int size)
+{
+    if (num_ops == max_ops) {
+	max_ops = (max_ops > 0) ? 2 * max_ops : 65536;
+	if ((ops = (traceop_t *)realloc(ops, max_ops * sizeof(traceop_t))) == NULL)
+	    gen_error("realloc failed in", "emit");
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = size;
+    num_ops++;
+    if (live_bytes > peak_bytes)
+	peak_bytes = live_bytes;
+}
+
+/*
+ * parse_dist - parse the distribution spec into d
+ */
+static void parse_dist(dist_t *d, char *spec)
+{
+    char path[MAXLINE];
+    double value, count, total = 0;
+    FILE *f;
+    int max = 0;
+
+    memset(d, 0, sizeof(*d));
+    if (sscanf(spec, "uniform:%lf:%lf", &d->a, &d->b) == 2 && d->a <= d->b)
+	d->kind = UNIFORM;
+    else if (sscanf(spec, "power:%lf:%lf:%lf", &d->a, &d->b, &d->c) == 3 &&
+	     d->a > 0 && d->a <= d->b && d->c > 0)
+	d->kind = POWER;
+    else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &d->a, &d->b, &d->c) == 3 &&
+	     d->c >= 0 && d->c <= 1)
+	d->kind = BIMODAL;
+    else if (sscanf(spec, "exp:%lf", &d->a) == 1 && d->a > 0)
+	d->kind = EXPONENTIAL;
+    else if (sscanf(spec, "hist:%1023s", path) == 1) {
+	d->kind = HISTOGRAM;
+	if ((f = fopen(path, "r")) == NULL)
+	    gen_error("Could not open histogram", path);
+	while (fscanf(f, "%lf %lf", &value, &count) == 2) {
+	    if (count <= 0)
+		continue;
+	    if (d->n == max) {
+		max = (max > 0) ? 2 * max : 64;
+		if ((d->values = (double *)realloc(d->values, max * sizeof(double))) == NULL ||
+		    (d->cum = (double *)realloc(d->cum, max * sizeof(double))) == NULL)
+		    gen_error("realloc failed in", "parse_dist");
+	    }
+	    total += count;
+	    d->values[d->n] = value;
+	    d->cum[d->n++] = total;
+	}
+	fclose(f);
+	if (d->n == 0)
+	    gen_error("No \"<value> <count>\" lines in histogram", path);
+    }
+    else
+	gen_error("Bad distribution", spec);
+}
+
+/*
+ * draw - draw a value from the distribution d
+ */
+static double draw(dist_t *d)
+{
+    double u = rnd(), la, lb;
+    int lo, hi, mid;
+
+    switch (d->kind) {
+    case UNIFORM:
+	return floor(d->a + u * (d->b - d->a + 1));
+    case POWER:  /* invert the CDF of the Pareto law cut to [a, b] */
+	la = pow(d->a, -d->c);
+	lb = pow(d->b, -d->c);
+	return floor(pow(la - u * (la - lb), -1 / d->c));
+    case BIMODAL:
+	return (u < d->c) ? d->a : d->b;
+    case EXPONENTIAL:
+	return floor(-d->a * log(1 - u));
+    default:  /* HISTOGRAM: the first value whose cumulative weight is past u */
+	u *= d->cum[d->n - 1];
+	for (lo = 0, hi = d->n - 1; lo < hi; ) {
+	    mid = (lo + hi) / 2;
+	    if (d->cum[mid] > u)
+		hi = mid;
+	    else
+		lo = mid + 1;
+	}
+	return d->values[lo];
+    }
+}
+
+/*
+ * rnd - a uniform random number in [0, 1), from the splitmix64 sequence,
+ *    so that a seed gives the same trace on any machine
+ */
+static double rnd(void)
+{
+    unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    z ^= z >> 31;
+    return (z >> 11) * (1.0 / 9007199254740992.0);  /* 53 bits */
+}
+
+/*
+ * usage - explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-lbzh] [-p <preset>] [-x <scale>] [-n <allocs>] [-s <seed>]\n");
+    fprintf(stderr, "                [-S <dist>] [-L <dist>] [-P <n>:<f>[:<s>]] [-R <p>:<g>[:<d>]]\n");
+    fprintf(stderr, "                [-T <n>[:<p>]] <out>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b             Write a binary trace.\n");
+    fprintf(stderr, "\t-h             Print this message.\n");
+    fprintf(stderr, "\t-l             List the presets.\n");
+    fprintf(stderr, "\t-L <dist>      Lifetimes, in allocations (default exp:1000).\n");
+    fprintf(stderr, "\t-n <allocs>    Allocations before scaling (default 10000).\n");
+    fprintf(stderr, "\t-p <preset>    Start from a preset.\n");
+    fprintf(stderr, "\t-P <n>:<f>:<s> n phases; fraction f of blocks die at phase end;\n");
+    fprintf(stderr, "\t               odd phases scale sizes by s.\n");
+    fprintf(stderr, "\t-R <p>:<g>:<d> Realloc a live block to g*size+d with probability p.\n");
+    fprintf(stderr, "\t-s <seed>      Seed of the random numbers (default 1).\n");
+    fprintf(stderr, "\t-S <dist>      Request sizes (default uniform:1:4096).\n");
+    fprintf(stderr, "\t-T <n>:<p>     Spread the ops over n threads; another thread frees\n");
+    fprintf(stderr, "\t               a block with probability p.\n");
+    fprintf(stderr, "\t-x <scale>     Multiply the length of the trace by scale.\n");
+    fprintf(stderr, "\t-z             Write a compressed trace.\n");
+    fprintf(stderr, "A <dist> is uniform:<lo>:<hi>, power:<lo>:<hi>:<alpha>,\n");
+    fprintf(stderr, "bimodal:<a>:<b>:<p>, exp:<mean> or hist:<file>.\n");
+}
+
+/*
+ * gen_error - report an error and terminate
+ */
+static void gen_error(char *msg, char *arg)
+{
+    fprintf(stderr, "tracegen: %s %s\n", msg, arg);
+    exit(1);
+}